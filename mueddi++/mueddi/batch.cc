@@ -0,0 +1,750 @@
+#include "mueddi.hh"
+#include "encoder.hh"
+#include "leven.hh"
+#include "wide.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace mueddi
+{
+
+// Query indices [begin, end) not yet taken, packed into one word so
+// that the owner (taking from the front) and thieves (taking the back
+// half) can shrink it with compare-and-swap.
+class WorkRange
+{
+public:
+    std::atomic<uint64_t> packed;
+
+    WorkRange();
+
+    void assign(size_t begin, size_t end);
+
+    // by the owner
+    bool take(size_t &index);
+
+    // moves the back half into thief, whose range must be empty
+    bool steal(WorkRange &thief);
+
+private:
+    static uint64_t pack(uint64_t begin, uint64_t end);
+};
+
+// Items [0, count) of a batch, processed by the threads of a pool.
+class PoolJob
+{
+public:
+    virtual ~PoolJob() = default;
+
+    // called by thread k of the pool
+    virtual void run(size_t k, size_t index) = 0;
+};
+
+class QueryJob : public PoolJob
+{
+public:
+    const Dawg &dawg;
+    std::span<const Query> queries;
+    ResultSink &sink;
+    const SearchOrder order;
+
+    // per thread, by n, reused within the batch
+    std::vector<std::vector<std::optional<InputIterator>>> iterators;
+
+    QueryJob(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order, size_t thread_count);
+
+    void run(size_t k, size_t index) override;
+};
+
+// Words starting with prefix; for an exact task, just prefix itself,
+// which is known to match.
+class SubtreeTask
+{
+public:
+    std::string prefix;
+    bool exact;
+    uint32_t ordinal;
+
+    // reached by prefix, to split the subtree further
+    TStateIndex dawg_state;
+    LevenState leven_state;
+
+    std::vector<std::pair<std::string, uint32_t>> matches;
+
+    SubtreeTask(const std::string &p, bool e, uint32_t o, TStateIndex q, const LevenState &m);
+};
+
+using TSubtreeTasks = std::vector<SubtreeTask>;
+
+class SubtreeJob : public PoolJob
+{
+public:
+    const Dawg &dawg;
+    const Query &query;
+    TSubtreeTasks &tasks;
+
+    SubtreeJob(const Dawg &dawg, const Query &query, TSubtreeTasks &tasks);
+
+    void run(size_t k, size_t index) override;
+};
+
+class PoolPayload
+{
+public:
+    // of the batch being run
+    PoolJob *job;
+    std::vector<WorkRange> ranges;
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+
+    // serializes batches
+    std::mutex batch_mutex;
+
+    // guards the fields below and error
+    std::mutex mutex;
+    std::condition_variable start_cond;
+    std::condition_variable done_cond;
+    size_t generation;
+    size_t active;
+    bool stopping;
+
+    std::vector<std::thread> workers;
+
+    // the pool whose items the current thread is processing, if any
+    static thread_local const PoolPayload *running_pool;
+
+    explicit PoolPayload(unsigned thread_count);
+    ~PoolPayload();
+    PoolPayload(const PoolPayload &) = delete;
+    PoolPayload &operator=(const PoolPayload &) = delete;
+
+    // runs job for all items; one batch at a time
+    void execute(PoolJob &job, size_t count);
+
+    void run_worker(size_t k);
+
+    // processes items of ranges[k] and, once they're taken, of other
+    // ranges
+    void run(size_t k);
+
+    bool next_item(size_t k, size_t &index);
+};
+
+// A query alive at a DAWG state of a shared traversal.
+class SharedEntry
+{
+public:
+    uint32_t query; // index into the facades of the group
+    LevenState leven_state;
+    LevenState foreign;
+
+    // of the facade (for WideFacade) before the state was entered
+    size_t state_mark;
+
+    SharedEntry(uint32_t q, const LevenState &m);
+};
+
+// A DAWG state on the path of the shared candidate, with the entries
+// [first_entry, entry_end) of the queries which reach it alive.
+class SharedFrame
+{
+public:
+    TStateIndex dawg_state;
+    uint32_t ordinal; // of the first word with candidate as prefix
+    size_t cursor;
+    size_t stop;
+    size_t length; // of the candidate in bytes
+    size_t first_entry;
+    size_t entry_end;
+
+    SharedFrame(TStateIndex q, uint32_t o, size_t s, size_t l, size_t f, size_t e);
+};
+
+// Searches for the queries with indices members, all with the same
+// n, in one depth-first traversal.
+template<typename F>
+class SharedSearch
+{
+public:
+    SharedSearch(const FrozenDawg &frozen, std::span<const Query> queries, const std::vector<uint32_t> &members, ResultSink &sink);
+
+    void run();
+
+private:
+    const FrozenDawg &frozen;
+    const std::vector<uint32_t> &members;
+    ResultSink &sink;
+    std::vector<F> facades;
+    std::vector<SharedEntry> entries;
+    std::vector<SharedFrame> stack;
+    std::string current;
+
+    // reports matches at q, of the entries from first up, and enters
+    // q unless it has no children
+    void enter(TStateIndex q, uint32_t ordinal, size_t first);
+
+    void leave();
+};
+
+// the tasks for the subtrees of the first level below the root with
+// at least target of them (but at most max_depth down), in
+// lexicographic order
+template<typename F>
+static void split(const FrozenDawg &frozen, const Query &query, size_t target, size_t max_depth, TSubtreeTasks &tasks);
+
+thread_local const PoolPayload *PoolPayload::running_pool = nullptr;
+
+inline WorkRange::WorkRange():
+    packed(0)
+{
+}
+
+inline void WorkRange::assign(size_t begin, size_t end)
+{
+    packed.store(pack(begin, end), std::memory_order_release);
+}
+
+inline bool WorkRange::take(size_t &index)
+{
+    uint64_t cur = packed.load(std::memory_order_acquire);
+    while (true) {
+        uint64_t begin = cur >> 32;
+        uint64_t end = cur & UINT32_MAX;
+        if (begin >= end) {
+            return false;
+        }
+
+        if (packed.compare_exchange_weak(cur, pack(begin + 1, end), std::memory_order_acq_rel)) {
+            index = begin;
+            return true;
+        }
+    }
+}
+
+inline bool WorkRange::steal(WorkRange &thief)
+{
+    uint64_t cur = packed.load(std::memory_order_acquire);
+    while (true) {
+        uint64_t begin = cur >> 32;
+        uint64_t end = cur & UINT32_MAX;
+        if (begin >= end) {
+            return false;
+        }
+
+        uint64_t middle = end - (end - begin + 1) / 2;
+        if (packed.compare_exchange_weak(cur, pack(begin, middle), std::memory_order_acq_rel)) {
+            thief.assign(middle, end);
+            return true;
+        }
+    }
+}
+
+inline uint64_t WorkRange::pack(uint64_t begin, uint64_t end)
+{
+    return (begin << 32) | end;
+}
+
+void ResultSink::done(size_t)
+{
+}
+
+CollectingSink::CollectingSink(size_t query_count):
+    results(query_count)
+{
+}
+
+void CollectingSink::add(size_t index, const std::string &word, uint32_t)
+{
+    results[index].push_back(word);
+}
+
+QueryJob::QueryJob(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order, size_t thread_count):
+    dawg(dawg),
+    queries(queries),
+    sink(sink),
+    order(order),
+    iterators(thread_count)
+{
+}
+
+void QueryJob::run(size_t k, size_t index)
+{
+    const Query &query = queries[index];
+    if (query.n > WideFacade::MAX_WIDE_N) {
+        // before it sizes the cache
+        throw std::runtime_error("number of corrections too big for this package");
+    }
+
+    std::vector<std::optional<InputIterator>> &own = iterators[k];
+    if (own.size() <= query.n) {
+        own.resize(query.n + 1);
+    }
+
+    std::optional<InputIterator> &cached = own[query.n];
+    if (cached) {
+        cached->restart(query.word);
+    } else {
+        cached.emplace(query.word, query.n, dawg, order);
+    }
+
+    for (InputIterator &it = *cached, end; it != end; ++it) {
+        sink.add(index, *it, it.get_ordinal());
+    }
+
+    sink.done(index);
+}
+
+SubtreeTask::SubtreeTask(const std::string &p, bool e, uint32_t o, TStateIndex q, const LevenState &m):
+    prefix(p),
+    exact(e),
+    ordinal(o),
+    dawg_state(q),
+    leven_state(m)
+{
+}
+
+SubtreeJob::SubtreeJob(const Dawg &dawg, const Query &query, TSubtreeTasks &tasks):
+    dawg(dawg),
+    query(query),
+    tasks(tasks)
+{
+}
+
+void SubtreeJob::run(size_t, size_t index)
+{
+    SubtreeTask &task = tasks[index];
+    if (task.exact) {
+        return;
+    }
+
+    for (InputIterator it(query.word, query.n, dawg, task.prefix), end; it != end; ++it) {
+        task.matches.emplace_back(*it, it.get_ordinal());
+    }
+}
+
+PoolPayload::PoolPayload(unsigned thread_count):
+    job(nullptr),
+    ranges(thread_count),
+    failed(false),
+    generation(0),
+    active(0),
+    stopping(false)
+{
+    // the calling thread is worker 0
+    for (unsigned k = 1; k < thread_count; ++k) {
+        workers.emplace_back(&PoolPayload::run_worker, this, k);
+    }
+}
+
+PoolPayload::~PoolPayload()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    start_cond.notify_all();
+    for (std::thread &worker: workers) {
+        worker.join();
+    }
+}
+
+void PoolPayload::execute(PoolJob &job, size_t count)
+{
+    if (count > UINT32_MAX) {
+        throw std::runtime_error("batch too big");
+    }
+
+    // the batch lock (held by the calling thread) and the workers
+    // (waited for by it) aren't reentrant
+    if (running_pool == this) {
+        throw std::runtime_error("search pool used from its own batch");
+    }
+
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+
+    this->job = &job;
+    failed.store(false, std::memory_order_relaxed);
+    error = nullptr;
+
+    size_t thread_count = ranges.size();
+    for (size_t k = 0; k < thread_count; ++k) {
+        ranges[k].assign(count * k / thread_count, count * (k + 1) / thread_count);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        active = workers.size();
+        ++generation;
+    }
+
+    start_cond.notify_all();
+    run(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cond.wait(lock, [this]() {
+        return !active;
+    });
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void PoolPayload::run_worker(size_t k)
+{
+    size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        start_cond.wait(lock, [&]() {
+            return stopping || (generation != seen_generation);
+        });
+
+        if (stopping) {
+            return;
+        }
+
+        seen_generation = generation;
+        lock.unlock();
+        run(k);
+        lock.lock();
+        if (!--active) {
+            done_cond.notify_all();
+        }
+    }
+}
+
+void PoolPayload::run(size_t k)
+{
+    const PoolPayload *outer = running_pool;
+    running_pool = this;
+
+    size_t index;
+    while (!failed.load(std::memory_order_relaxed) && next_item(k, index)) {
+        try {
+            job->run(k, index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+
+            failed.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    running_pool = outer;
+}
+
+bool PoolPayload::next_item(size_t k, size_t &index)
+{
+    while (true) {
+        if (ranges[k].take(index)) {
+            return true;
+        }
+
+        bool stolen = false;
+        for (size_t i = 1; !stolen && (i < ranges.size()); ++i) {
+            stolen = ranges[(k + i) % ranges.size()].steal(ranges[k]);
+        }
+
+        if (!stolen) {
+            return false;
+        }
+    }
+}
+
+SearchPool::SearchPool(unsigned thread_count)
+{
+    if (!thread_count) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    payload = std::make_unique<PoolPayload>(thread_count);
+}
+
+SearchPool::~SearchPool()
+{
+}
+
+unsigned SearchPool::get_thread_count() const
+{
+    return payload->ranges.size();
+}
+
+void SearchPool::search_batch(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order)
+{
+    QueryJob job(dawg, queries, sink, order, get_thread_count());
+    payload->execute(job, queries.size());
+}
+
+void SearchPool::search_parallel(const Dawg &dawg, const Query &query, ResultSink &sink)
+{
+    const FrozenDawg &frozen = dawg.get_frozen();
+    TSubtreeTasks tasks;
+
+    // enough work to balance
+    size_t target = 8 * get_thread_count();
+    switch (query.n) {
+    case 1:
+        split<BasicFacade<1>>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        break;
+    case 2:
+        split<BasicFacade<2>>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        break;
+    case 3:
+        split<BasicFacade<3>>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        break;
+    case 4:
+        split<BasicFacade<4>>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        break;
+    default:
+        if (query.n > MAX_N) {
+            split<WideFacade>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        } else {
+            split<Facade>(frozen, query, target, MAX_SPLIT_DEPTH, tasks);
+        }
+    }
+
+    SubtreeJob job(dawg, query, tasks);
+    payload->execute(job, tasks.size());
+
+    for (const SubtreeTask &task: tasks) {
+        if (task.exact) {
+            sink.add(0, task.prefix, task.ordinal);
+        }
+
+        for (const std::pair<std::string, uint32_t> &match: task.matches) {
+            sink.add(0, match.first, match.second);
+        }
+    }
+
+    sink.done(0);
+}
+
+template<typename F>
+static void split(const FrozenDawg &frozen, const Query &query, size_t target, size_t max_depth, TSubtreeTasks &tasks)
+{
+    F facade = make_facade<F>(query.word, query.n);
+    tasks.emplace_back(std::string(), false, 0, frozen.get_root(), F::initial_state());
+
+    // each level splits the subtrees of the one above
+    char buf[5];
+    TSubtreeTasks next;
+    for (size_t depth = 1; (depth <= max_depth) && (tasks.size() < target); ++depth) {
+        next.clear();
+        for (SubtreeTask &task: tasks) {
+            if (task.exact) {
+                next.push_back(std::move(task));
+                continue;
+            }
+
+            TStateIndex q = task.dawg_state;
+            if (frozen.is_final(q) && facade.is_final(task.leven_state)) {
+                next.emplace_back(task.prefix, true, task.ordinal, q, task.leven_state);
+            }
+
+            for (const FrozenEdge *it = frozen.begin(q); it != frozen.end(q); ++it) {
+                LevenState mp = facade.delta(task.leven_state, it->letter);
+                if (!mp.is_dead()) {
+                    std::string prefix = task.prefix;
+                    prefix.append(buf, utf8_encode(buf, it->letter));
+                    next.emplace_back(prefix, false, task.ordinal + frozen.get_rank(q, it), it->target, mp);
+                }
+            }
+        }
+
+        tasks.swap(next);
+    }
+}
+
+inline SharedEntry::SharedEntry(uint32_t q, const LevenState &m):
+    query(q),
+    leven_state(m),
+    foreign(m),
+    state_mark(0)
+{
+}
+
+inline SharedFrame::SharedFrame(TStateIndex q, uint32_t o, size_t s, size_t l, size_t f, size_t e):
+    dawg_state(q),
+    ordinal(o),
+    cursor(0),
+    stop(s),
+    length(l),
+    first_entry(f),
+    entry_end(e)
+{
+}
+
+template<typename F>
+SharedSearch<F>::SharedSearch(const FrozenDawg &frozen, std::span<const Query> queries, const std::vector<uint32_t> &members, ResultSink &sink):
+    frozen(frozen),
+    members(members),
+    sink(sink)
+{
+    for (uint32_t index: members) {
+        facades.push_back(make_facade<F>(queries[index].word, queries[index].n));
+    }
+}
+
+template<typename F>
+void SharedSearch<F>::run()
+{
+    for (uint32_t i = 0; i < facades.size(); ++i) {
+        entries.emplace_back(i, F::initial_state());
+    }
+
+    enter(frozen.get_root(), 0, 0);
+
+    char buf[5];
+    while (!stack.empty()) {
+        SharedFrame &top = stack.back();
+        if (top.cursor == top.stop) {
+            leave();
+            continue;
+        }
+
+        const FrozenEdge *it = frozen.begin(top.dawg_state) + top.cursor++;
+        uint32_t x = it->letter;
+        size_t first = entries.size();
+        for (size_t j = top.first_entry; j < top.entry_end; ++j) {
+            SharedEntry entry = entries[j]; // entries may grow
+            F &facade = facades[entry.query];
+            LevenState mp = facade.has_letter(x) ? facade.delta(entry.leven_state, x) : entry.foreign;
+            if (!mp.is_dead()) {
+                entries.emplace_back(entry.query, mp);
+            }
+        }
+
+        // all queries are dead in the subtree
+        if (entries.size() == first) {
+            continue;
+        }
+
+        current.resize(top.length);
+        current.append(buf, utf8_encode(buf, x));
+
+        // invalidates top
+        enter(it->target, top.ordinal + frozen.get_rank(top.dawg_state, it), first);
+    }
+
+    for (uint32_t index: members) {
+        sink.done(index);
+    }
+}
+
+template<typename F>
+void SharedSearch<F>::enter(TStateIndex q, uint32_t ordinal, size_t first)
+{
+    if (frozen.is_final(q)) {
+        for (size_t j = first; j < entries.size(); ++j) {
+            const SharedEntry &entry = entries[j];
+            if (facades[entry.query].is_final(entry.leven_state)) {
+                sink.add(members[entry.query], current, ordinal);
+            }
+        }
+    }
+
+    size_t fan_out = frozen.end(q) - frozen.begin(q);
+    if (!fan_out) {
+        entries.erase(entries.begin() + first, entries.end());
+        return;
+    }
+
+    // all letters not in a window lead to the same state
+    for (size_t j = first; j < entries.size(); ++j) {
+        SharedEntry &entry = entries[j];
+        F &facade = facades[entry.query];
+        if constexpr (std::is_same_v<F, WideFacade>) {
+            entry.state_mark = facade.get_state_count();
+        }
+
+        entry.foreign = facade.delta_foreign(entry.leven_state);
+    }
+
+    stack.emplace_back(q, ordinal, fan_out, current.size(), first, entries.size());
+}
+
+template<typename F>
+void SharedSearch<F>::leave()
+{
+    const SharedFrame &top = stack.back();
+    if constexpr (std::is_same_v<F, WideFacade>) {
+        // only the finished subtree used states computed since
+        for (size_t j = top.first_entry; j < top.entry_end; ++j) {
+            facades[entries[j].query].truncate(entries[j].state_mark);
+        }
+    }
+
+    entries.erase(entries.begin() + top.first_entry, entries.end());
+    stack.pop_back();
+}
+
+void search_shared(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink)
+{
+    if (queries.size() > UINT32_MAX) {
+        throw std::runtime_error("batch too big");
+    }
+
+    // one traversal for each tolerance
+    std::map<size_t, std::vector<uint32_t>> groups;
+    for (uint32_t i = 0; i < queries.size(); ++i) {
+        groups[queries[i].n].push_back(i);
+    }
+
+    const FrozenDawg &frozen = dawg.get_frozen();
+    for (const auto &[n, members]: groups) {
+        switch (n) {
+        case 1:
+            SharedSearch<BasicFacade<1>>(frozen, queries, members, sink).run();
+            break;
+        case 2:
+            SharedSearch<BasicFacade<2>>(frozen, queries, members, sink).run();
+            break;
+        case 3:
+            SharedSearch<BasicFacade<3>>(frozen, queries, members, sink).run();
+            break;
+        case 4:
+            SharedSearch<BasicFacade<4>>(frozen, queries, members, sink).run();
+            break;
+        default:
+            if (n > MAX_N) {
+                SharedSearch<WideFacade>(frozen, queries, members, sink).run();
+            } else {
+                SharedSearch<Facade>(frozen, queries, members, sink).run();
+            }
+        }
+    }
+}
+
+static SearchPool &get_default_pool()
+{
+    // initialization of a local static is thread-safe
+    static SearchPool pool;
+    return pool;
+}
+
+void search_batch(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order)
+{
+    get_default_pool().search_batch(dawg, queries, sink, order);
+}
+
+void search_parallel(const Dawg &dawg, const Query &query, ResultSink &sink)
+{
+    get_default_pool().search_parallel(dawg, query, sink);
+}
+
+}
@@ -0,0 +1,194 @@
+#ifndef mueddi_concurrent_map_hh
+#define mueddi_concurrent_map_hh
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
+#include "struct_hash.hh"
+
+namespace mueddi
+{
+
+// Insert-only hash map whose lookups don't lock. Entries are
+// immutable once published and the slot arrays replaced by growth
+// are kept until destruction, so a reader holding an old array still
+// sees valid (if possibly incomplete) data; a miss is confirmed by
+// the insertion, which takes a mutex.
+template<typename K, typename V, typename H = std::hash<K>, typename E = std::equal_to<K>>
+class ConcurrentMap
+{
+public:
+    ConcurrentMap();
+    ~ConcurrentMap();
+    ConcurrentMap(const ConcurrentMap &) = delete;
+    ConcurrentMap &operator=(const ConcurrentMap &) = delete;
+
+    // returns nullptr if key isn't present; the returned value is
+    // valid for the lifetime of the map
+    const V *find(const K &key) const;
+
+    // inserts value unless key is already present, returning the
+    // value in the map
+    const V &insert(const K &key, V &&value);
+
+    size_t size() const;
+
+private:
+    class Entry
+    {
+    public:
+        const size_t hash;
+        const K key;
+        const V value;
+
+        Entry(size_t h, const K &k, V &&v);
+    };
+
+    class Table
+    {
+    public:
+        const size_t mask;
+        std::unique_ptr<std::atomic<Entry *>[]> slots;
+
+        explicit Table(size_t size);
+    };
+
+    static constexpr size_t INITIAL_SIZE = 64;
+
+    const Entry *find(const Table &table, size_t h, const K &key) const;
+
+    void grow();
+
+    std::atomic<Table *> current;
+    mutable std::mutex mutex;
+
+    // all tables ever allocated, the current one last
+    std::vector<std::unique_ptr<Table>> tables;
+    size_t count;
+};
+
+template<typename K, typename V, typename H, typename E>
+ConcurrentMap<K, V, H, E>::ConcurrentMap():
+    count(0)
+{
+    tables.push_back(std::make_unique<Table>(INITIAL_SIZE));
+    current.store(tables.back().get(), std::memory_order_release);
+}
+
+template<typename K, typename V, typename H, typename E>
+ConcurrentMap<K, V, H, E>::~ConcurrentMap()
+{
+    Table *table = current.load(std::memory_order_relaxed);
+    for (size_t i = 0; i <= table->mask; ++i) {
+        delete table->slots[i].load(std::memory_order_relaxed);
+    }
+}
+
+template<typename K, typename V, typename H, typename E>
+const V *ConcurrentMap<K, V, H, E>::find(const K &key) const
+{
+    const Entry *entry = find(*current.load(std::memory_order_acquire), H()(key), key);
+    return entry ? &(entry->value) : nullptr;
+}
+
+template<typename K, typename V, typename H, typename E>
+const V &ConcurrentMap<K, V, H, E>::insert(const K &key, V &&value)
+{
+    size_t h = H()(key);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Table *table = current.load(std::memory_order_relaxed);
+    const Entry *entry = find(*table, h, key);
+    if (entry) {
+        return entry->value;
+    }
+
+    if (2 * (count + 1) > table->mask + 1) {
+        grow();
+        table = current.load(std::memory_order_relaxed);
+    }
+
+    Entry *added = new Entry(h, key, std::move(value));
+    size_t i = hash_finish(h) & table->mask;
+    while (table->slots[i].load(std::memory_order_relaxed)) {
+        i = (i + 1) & table->mask;
+    }
+
+    table->slots[i].store(added, std::memory_order_release);
+    ++count;
+    return added->value;
+}
+
+template<typename K, typename V, typename H, typename E>
+size_t ConcurrentMap<K, V, H, E>::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+}
+
+template<typename K, typename V, typename H, typename E>
+const typename ConcurrentMap<K, V, H, E>::Entry *ConcurrentMap<K, V, H, E>::find(const Table &table, size_t h, const K &key) const
+{
+    size_t i = hash_finish(h) & table.mask;
+    while (true) {
+        const Entry *entry = table.slots[i].load(std::memory_order_acquire);
+        if (!entry) {
+            return nullptr;
+        }
+
+        if ((entry->hash == h) && E()(entry->key, key)) {
+            return entry;
+        }
+
+        i = (i + 1) & table.mask;
+    }
+}
+
+// called with the mutex held
+template<typename K, typename V, typename H, typename E>
+void ConcurrentMap<K, V, H, E>::grow()
+{
+    Table *old = current.load(std::memory_order_relaxed);
+    auto table = std::make_unique<Table>(2 * (old->mask + 1));
+    for (size_t j = 0; j <= old->mask; ++j) {
+        Entry *entry = old->slots[j].load(std::memory_order_relaxed);
+        if (entry) {
+            size_t i = hash_finish(entry->hash) & table->mask;
+            while (table->slots[i].load(std::memory_order_relaxed)) {
+                i = (i + 1) & table->mask;
+            }
+
+            table->slots[i].store(entry, std::memory_order_relaxed);
+        }
+    }
+
+    tables.push_back(std::move(table));
+    current.store(tables.back().get(), std::memory_order_release);
+}
+
+template<typename K, typename V, typename H, typename E>
+ConcurrentMap<K, V, H, E>::Entry::Entry(size_t h, const K &k, V &&v):
+    hash(h),
+    key(k),
+    value(std::move(v))
+{
+}
+
+template<typename K, typename V, typename H, typename E>
+ConcurrentMap<K, V, H, E>::Table::Table(size_t size):
+    mask(size - 1),
+    slots(new std::atomic<Entry *>[size])
+{
+    for (size_t i = 0; i < size; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+}
+
+#endif
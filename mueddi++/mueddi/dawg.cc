@@ -1,93 +1,392 @@
 #include "dawg.hh"
 #include "decoder.hh"
 #include "encoder.hh"
+#include "struct_hash.hh"
 
 #include <algorithm>
-#include <set>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <future>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace mueddi
 {
 
-class Builder
+// On-disk layout: FileHeader, state array (including the sentinel),
+// padding to 8 bytes, edge array. Numbers are in native byte order,
+// which is recorded so that a file from a different architecture is
+// rejected rather than misread.
+class FileHeader
 {
 public:
-    Builder(bool root_final);
-    Builder(const Builder &) = delete;
-    Builder &operator=(const Builder &) = delete;
+    static constexpr uint32_t VERSION = 2;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
 
-    void build(const TWords &words);
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t root;
+    uint32_t reserved;
+    uint64_t state_size;
+    uint64_t edge_size;
 
-    Dawg dawg;
+    static const char *get_magic();
+
+    static size_t get_edge_offset(uint64_t state_size);
+};
+
+static_assert(std::is_trivially_copyable_v<FileHeader>);
+static_assert(std::is_trivially_copyable_v<FrozenState>);
+static_assert(std::is_trivially_copyable_v<FrozenEdge>);
+static_assert(sizeof(FileHeader) % 8 == 0);
+static_assert(sizeof(FrozenState) == 4);
+static_assert(sizeof(FrozenEdge) == 12);
+
+class FrozenDawg::MappedFile
+{
+public:
+    const char *data;
+    size_t size;
+
+    MappedFile(const std::string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+// Hash-consing store of minimized states: each distinct combination
+// of finality and edges is appended to the state and edge arrays once
+// (so they're in post-order, with each state's edges contiguous) and
+// found again through an open-addressing table of state indices.
+class Register : public std::enable_shared_from_this<Register>
+{
+public:
+    Register();
+    Register(const Register &) = delete;
+    Register &operator=(const Register &) = delete;
+
+    bool is_final(TStateIndex state) const;
+
+    // pointers are valid until the next intern
+    const FrozenEdge *begin(TStateIndex state) const;
+    const FrozenEdge *end(TStateIndex state) const;
+
+    TStateIndex get_child(TStateIndex state, uint32_t letter) const;
+
+    uint32_t get_word_count(TStateIndex state) const;
+
+    bool is_dead(TStateIndex state) const;
+
+    // returns the index of an equivalent registered state, appending
+    // a new one (with edge ranks computed) if there's none
+    TStateIndex intern(bool finl, const FrozenEdge *begin, const FrozenEdge *end);
+
+    // interns a copy of state with a different finality
+    TStateIndex with_final(TStateIndex state, bool finl);
+
+    // interns a copy of state with the edge for letter redirected to
+    // target, added if it doesn't exist or removed if target is
+    // NO_STATE
+    TStateIndex with_edge(TStateIndex state, uint32_t letter, TStateIndex target);
+
+    // interns the states reachable from the source root, returning
+    // the new root
+    TStateIndex copy_reachable(const FrozenDawg &source);
+
+    // interns the states reachable from the source root except the
+    // root itself, whose edges are appended (translated) to
+    // root_edges
+    void copy_below(const FrozenDawg &source, FrozenDawg::TEdges &root_edges);
+
+    // true when modifications left too many unreachable states
+    bool needs_compaction() const;
+
+    // hands over the arrays; the register is empty afterwards
+    std::shared_ptr<FrozenDawg> freeze(TStateIndex root);
+
+    // the view keeps the register alive, but is invalidated by
+    // interning
+    std::shared_ptr<FrozenDawg> make_view(TStateIndex root);
 
 private:
-    using TRegister = std::set<DawgStateRef>;
+    class Slot
+    {
+    public:
+        size_t hash;
+        TStateIndex state;
+
+        Slot();
+    };
 
-    void replace_or_register(DawgStateRef state);
+    using TSlots = std::vector<Slot>;
 
-    void add_suffix(const DawgStateRef &state, const std::string &suffix);
+    static size_t hash_state(bool finl, const FrozenEdge *begin, const FrozenEdge *end);
 
-    TRegister registr;
+    bool equals(TStateIndex state, bool finl, const FrozenEdge *begin, const FrozenEdge *end) const;
+
+    void grow();
+
+    FrozenDawg::TStates states;
+    FrozenDawg::TEdges edges;
+    TSlots slots;
+    size_t count;
+    size_t live_size;
+    FrozenDawg::TEdges scratch;
 };
 
-DawgStateRef DawgState::get_child(uint32_t letter)
+static void decode_word(std::string_view word, std::vector<uint32_t> &letters)
 {
-    auto it = children.find(letter);
-    if (it == children.end()) {
-        return DawgStateRef();
-    } else {
-        return it->second;
+    letters.clear();
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t ch = 0xdeadbeef;
+    for (unsigned char c: word) {
+        if (!decode(&state, &ch, c)) {
+            letters.push_back(ch);
+        } else if (state == UTF8_REJECT) {
+            break;
+        }
+    }
+
+    if (state != UTF8_ACCEPT) {
+        throw std::runtime_error("word has invalid UTF-8");
     }
 }
 
-DawgStateRef DawgState::last_child()
+// fills path with the states along the longest prefix of letters
+// present in graph, returning whether it's all of them
+template<typename G>
+static bool find_path(const G &graph, TStateIndex root, const std::vector<uint32_t> &letters, std::vector<TStateIndex> &path)
 {
-    auto it = children.rbegin();
-    if (it == children.rend()) {
-        return DawgStateRef();
-    } else {
-        return it->second;
+    path.clear();
+    path.push_back(root);
+    for (uint32_t letter: letters) {
+        TStateIndex next = graph.get_child(path.back(), letter);
+        if (next == FrozenDawg::NO_STATE) {
+            return false;
+        }
+
+        path.push_back(next);
     }
+
+    return true;
 }
 
-void DawgState::set_last_child(const DawgStateRef &child)
+const char *FileHeader::get_magic()
 {
-    auto it = children.rbegin();
-    assert(it != children.rend());
-    it->second = child;
+    return "MUEDDAWG";
 }
 
-void DawgState::add_child(uint32_t letter, const DawgStateRef &child)
+size_t FileHeader::get_edge_offset(uint64_t state_size)
 {
-    auto p = children.insert(TChildren::value_type(letter, child));
-    assert(p.second);
+    size_t end = sizeof(FileHeader) + state_size * sizeof(FrozenState);
+    return (end + 7) & ~static_cast<size_t>(7);
 }
 
-void DawgState::dump(std::ostream &os) const
+FrozenDawg::MappedFile::MappedFile(const std::string &path):
+    data(nullptr),
+    size(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || (st.st_size < static_cast<off_t>(sizeof(FileHeader)))) {
+        close(fd);
+        throw std::runtime_error("not a dawg file: " + path);
+    }
+
+    size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+
+    data = static_cast<const char *>(addr);
+}
+
+FrozenDawg::MappedFile::~MappedFile()
+{
+    munmap(const_cast<char *>(data), size);
+}
+
+FrozenDawg::FrozenDawg(TStates &&states, TEdges &&edges, TStateIndex root):
+    own_states(std::move(states)),
+    own_edges(std::move(edges)),
+    states(own_states.data()),
+    state_size(own_states.size()),
+    edges(own_edges.data()),
+    edge_size(own_edges.size()),
+    root(root)
+{
+    assert(state_size);
+    assert(this->states[state_size - 1].get_first_edge() == edge_size);
+    assert(root < get_state_count());
+}
+
+FrozenDawg::FrozenDawg(const std::string &path)
+{
+    auto mapping = std::make_shared<MappedFile>(path);
+    owner = mapping;
+
+    const FileHeader *header = reinterpret_cast<const FileHeader *>(mapping->data);
+    if (memcmp(header->magic, FileHeader::get_magic(), sizeof(header->magic))) {
+        throw std::runtime_error("not a dawg file: " + path);
+    }
+
+    if (header->byte_order != FileHeader::BYTE_ORDER_MARK) {
+        throw std::runtime_error("dawg file has foreign byte order: " + path);
+    }
+
+    if (header->version != FileHeader::VERSION) {
+        throw std::runtime_error("unsupported dawg file version: " + path);
+    }
+
+    size_t edge_offset = FileHeader::get_edge_offset(header->state_size);
+    if (!header->state_size || (header->state_size > FrozenDawg::NO_STATE) ||
+        (header->edge_size >= 0x80000000) ||
+        (mapping->size != edge_offset + header->edge_size * sizeof(FrozenEdge))) {
+        throw std::runtime_error("dawg file has invalid size: " + path);
+    }
+
+    states = reinterpret_cast<const FrozenState *>(mapping->data + sizeof(FileHeader));
+    state_size = header->state_size;
+    edges = reinterpret_cast<const FrozenEdge *>(mapping->data + edge_offset);
+    edge_size = header->edge_size;
+    root = header->root;
+    if ((states[state_size - 1].get_first_edge() != edge_size) || (root >= get_state_count())) {
+        throw std::runtime_error("dawg file is corrupt: " + path);
+    }
+
+    // Indices, letter order and ranks are checked once here, so that
+    // lookups needn't. Builders add a state after its children, so a
+    // target must precede its source, which also rules out cycles.
+    for (TStateIndex q = 0; q < get_state_count(); ++q) {
+        if (states[q].get_first_edge() > states[q + 1].get_first_edge()) {
+            throw std::runtime_error("dawg file is corrupt: " + path);
+        }
+
+        uint64_t count = is_final(q);
+        for (const FrozenEdge *it = begin(q); it != end(q); ++it) {
+            if ((it->target >= q) || ((it != begin(q)) && (it->letter <= (it - 1)->letter))) {
+                throw std::runtime_error("dawg file is corrupt: " + path);
+            }
+
+            count += get_word_count(it->target);
+            if (it->rank != count) {
+                throw std::runtime_error("dawg file is corrupt: " + path);
+            }
+        }
+    }
+}
+
+FrozenDawg::FrozenDawg(const FrozenState *states, size_t state_size, const FrozenEdge *edges, size_t edge_size, TStateIndex root, const std::shared_ptr<const void> &owner):
+    owner(owner),
+    states(states),
+    state_size(state_size),
+    edges(edges),
+    edge_size(edge_size),
+    root(root)
+{
+    assert(state_size);
+    assert(states[state_size - 1].get_first_edge() == edge_size);
+    assert(root < get_state_count());
+}
+
+FrozenDawg::~FrozenDawg()
+{
+}
+
+const FrozenEdge *FrozenDawg::find_edge(TStateIndex state, uint32_t letter) const
+{
+    const FrozenEdge *e = end(state);
+    const FrozenEdge *it = std::lower_bound(
+        begin(state), e, letter, [](const FrozenEdge &edge, uint32_t l) {
+            return edge.letter < l; });
+
+    return ((it == e) || (it->letter != letter)) ? nullptr : it;
+}
+
+TStateIndex FrozenDawg::get_child(TStateIndex state, uint32_t letter) const
+{
+    const FrozenEdge *edge = find_edge(state, letter);
+    return edge ? edge->target : NO_STATE;
+}
+
+void FrozenDawg::dump(std::ostream &os, TStateIndex state) const
 {
     char buf[5];
 
-    os << ( finl ? 't' : 'f' ) << " {";
+    os << ( is_final(state) ? 't' : 'f' ) << " {";
     std::string delim(" ");
-    for (TChildren::const_iterator it = children.begin(); it != children.end(); ++it) {
+    for (const FrozenEdge *it = begin(state); it != end(state); ++it) {
         os << delim;
-        utf8_encode(buf, it->first);
-        os << '\'' << buf << "\': " << it->second;
+        utf8_encode(buf, it->letter);
+        os << '\'' << buf << "\': ";
+        dump(os, it->target);
         delim = ", ";
     }
 
     os << " }";
 }
 
-Dawg::Dawg(bool root_final):
-    root(std::make_shared<DawgState>(root_final))
+void FrozenDawg::save(const std::string &path) const
+{
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FileHeader::get_magic(), sizeof(header.magic));
+    header.version = FileHeader::VERSION;
+    header.byte_order = FileHeader::BYTE_ORDER_MARK;
+    header.root = root;
+    header.state_size = state_size;
+    header.edge_size = edge_size;
+
+    // written next to path and renamed over it, so that processes
+    // which have mapped the old file keep its pages
+    static std::atomic<unsigned> save_count(0);
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(save_count++);
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(states), state_size * sizeof(FrozenState));
+
+    size_t edge_offset = FileHeader::get_edge_offset(state_size);
+    const char padding[8] = { 0 };
+    out.write(padding, edge_offset - sizeof(header) - state_size * sizeof(FrozenState));
+    out.write(reinterpret_cast<const char *>(edges), edge_size * sizeof(FrozenEdge));
+    out.close();
+    if (!out || rename(tmp_path.c_str(), path.c_str())) {
+        unlink(tmp_path.c_str());
+        throw std::runtime_error("cannot write " + path);
+    }
+}
+
+Dawg::Dawg(bool root_final)
+{
+    FrozenDawg::TStates states;
+    states.emplace_back(root_final, 0);
+    states.emplace_back(false, 0);
+    frozen = std::make_shared<FrozenDawg>(std::move(states), FrozenDawg::TEdges(), 0);
+}
+
+Dawg::Dawg(const std::shared_ptr<const FrozenDawg> &frozen):
+    frozen(frozen)
 {
 }
 
 Dawg::Dawg(const Dawg &other):
-    root(other.root)
+    frozen(other.frozen)
 {
 }
 
@@ -97,16 +396,128 @@ Dawg::~Dawg()
 
 Dawg &Dawg::operator=(const Dawg &other)
 {
-    root = other.root;
+    // like the copy constructor, this doesn't take over the register,
+    // which stays with the views of it (possibly held by copies)
+    frozen = other.frozen;
+    registr.reset();
     return *this;
 }
 
-bool Dawg::accepts(const std::string &w)
+void Dawg::save(const std::string &path) const
+{
+    frozen->save(path);
+}
+
+Dawg Dawg::open_mmap(const std::string &path)
+{
+    return Dawg(std::make_shared<FrozenDawg>(path));
+}
+
+bool Dawg::insert(const std::string &word)
+{
+    std::vector<uint32_t> letters;
+    decode_word(word, letters);
+
+    std::vector<TStateIndex> path;
+    if (find_path(*frozen, frozen->get_root(), letters, path) && frozen->is_final(path.back())) {
+        return false;
+    }
+
+    TStateIndex old_root = detach();
+    try {
+        find_path(*registr, old_root, letters, path); // in the numbering of the register
+        size_t common = path.size() - 1;
+        size_t len = letters.size();
+        TStateIndex tail;
+        if (common == len) {
+            tail = registr->with_final(path[common], true);
+        } else {
+            tail = registr->intern(true, nullptr, nullptr);
+            for (size_t i = len - 1; i > common; --i) {
+                FrozenEdge edge(letters[i], tail);
+                tail = registr->intern(false, &edge, &edge + 1);
+            }
+
+            tail = registr->with_edge(path[common], letters[common], tail);
+        }
+
+        for (size_t i = common; i-- > 0; ) {
+            tail = registr->with_edge(path[i], letters[i], tail);
+        }
+
+        attach(tail);
+    } catch (...) {
+        attach(old_root);
+        throw;
+    }
+
+    return true;
+}
+
+bool Dawg::erase(const std::string &word)
+{
+    std::vector<uint32_t> letters;
+    decode_word(word, letters);
+
+    std::vector<TStateIndex> path;
+    if (!find_path(*frozen, frozen->get_root(), letters, path) || !frozen->is_final(path.back())) {
+        return false;
+    }
+
+    TStateIndex old_root = detach();
+    try {
+        find_path(*registr, old_root, letters, path);
+        size_t len = letters.size();
+        TStateIndex tail = registr->with_final(path[len], false);
+        for (size_t i = len; i-- > 0; ) {
+            // dead states are cut off rather than shared
+            tail = registr->with_edge(path[i], letters[i], registr->is_dead(tail) ? FrozenDawg::NO_STATE : tail);
+        }
+
+        attach(tail);
+    } catch (...) {
+        attach(old_root);
+        throw;
+    }
+
+    return true;
+}
+
+// makes registr exclusively owned and up to date (which may renumber
+// the states) and drops the view of it, returning the root
+TStateIndex Dawg::detach()
+{
+    std::shared_ptr<const FrozenDawg> old;
+    old.swap(frozen);
+
+    // an exclusive register is referenced by this and by the view
+    if (registr && (old.use_count() == 1) && (registr.use_count() == 2) && !registr->needs_compaction()) {
+        return old->get_root();
+    }
+
+    auto fresh = std::make_shared<Register>();
+    TStateIndex root;
+    try {
+        root = fresh->copy_reachable(*old);
+    } catch (...) {
+        frozen.swap(old);
+        throw;
+    }
+
+    registr = fresh;
+    return root;
+}
+
+void Dawg::attach(TStateIndex root)
+{
+    frozen = registr->make_view(root);
+}
+
+bool Dawg::accepts(const std::string &w) const
 {
     const unsigned char *u = reinterpret_cast<const unsigned char *>(w.c_str());
 
-    DawgStateRef node = root;
-    assert(node.get());
+    TStateIndex node = frozen->get_root();
 
     uint32_t state = UTF8_ACCEPT;
     uint32_t codepoint = 0xdeadbeef;
@@ -121,11 +532,11 @@ bool Dawg::accepts(const std::string &w)
 
         if (!*u) {
             assert(!codepoint);
-            return node->is_final();
+            return frozen->is_final(node);
         }
 
-        node = node->get_child(codepoint);
-        if (!node) {
+        node = frozen->get_child(node, codepoint);
+        if (node == FrozenDawg::NO_STATE) {
             return false;
         }
 
@@ -133,121 +544,638 @@ bool Dawg::accepts(const std::string &w)
     }
 }
 
-Dawg::TPrefixState Dawg::track_prefix(const std::string &word)
+bool Dawg::contains(std::string_view word) const
 {
-    const unsigned char *start, *u = reinterpret_cast<const unsigned char *>(word.c_str());
-    std::string prefix;
-    DawgStateRef next_state = root;
-    DawgStateRef prev_state = next_state; // for empty word
+    TStateIndex node = frozen->get_root();
 
     uint32_t state = UTF8_ACCEPT;
-    uint32_t ch = 0xdeadbeef;
-    while (true) {
-        start = u;
-        while (decode(&state, &ch, *u)) {
-            ++u;
+    uint32_t codepoint = 0;
+    for (char c: word) {
+        state = decode(&state, &codepoint, static_cast<unsigned char>(c));
+        if (state == UTF8_ACCEPT) {
+            node = frozen->get_child(node, codepoint);
+            if (node == FrozenDawg::NO_STATE) {
+                return false;
+            }
+        } else if (state == UTF8_REJECT) {
+            return false;
         }
+    }
 
-        if (state != UTF8_ACCEPT) {
-            throw std::runtime_error("word has invalid UTF-8");
+    return (state == UTF8_ACCEPT) && frozen->is_final(node);
+}
+
+void Dawg::contains_many(std::span<const std::string_view> words, std::vector<bool> &found) const
+{
+    found.assign(words.size(), false);
+
+    std::vector<size_t> order(words.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&words](size_t x, size_t y) {
+            return words[x] < words[y];
+        });
+
+    // path[k] is the state reached after path_ends[k] bytes of the
+    // previous word; a prefix of dead_end bytes (or more) leads
+    // nowhere
+    std::vector<TStateIndex> path;
+    std::vector<size_t> path_ends;
+    size_t dead_end = SIZE_MAX;
+    std::string_view prev;
+    for (size_t i: order) {
+        std::string_view word = words[i];
+        size_t common = 0;
+        size_t limit = std::min(prev.size(), word.size());
+        while ((common < limit) && (prev[common] == word[common])) {
+            ++common;
         }
 
-        if (!*u) {
-            break;
+        prev = word;
+        if (common >= dead_end) {
+            continue;
         }
 
-        ++u;
+        dead_end = SIZE_MAX;
+        if (path.empty()) {
+            path.push_back(frozen->get_root());
+            path_ends.push_back(0);
+        }
 
-        prev_state = next_state;
-        next_state = prev_state->get_child(ch);
-        if (!next_state) {
-            break;
-        } else {
-            prefix.append(reinterpret_cast<const char *>(start), reinterpret_cast<const char *>(u));
+        while (path_ends.back() > common) {
+            path.pop_back();
+            path_ends.pop_back();
+        }
+
+        TStateIndex node = path.back();
+        uint32_t state = UTF8_ACCEPT;
+        uint32_t codepoint = 0;
+        for (size_t j = path_ends.back(); j < word.size(); ++j) {
+            state = decode(&state, &codepoint, static_cast<unsigned char>(word[j]));
+            if (state == UTF8_ACCEPT) {
+                node = frozen->get_child(node, codepoint);
+                if (node == FrozenDawg::NO_STATE) {
+                    dead_end = j + 1;
+                    break;
+                }
+
+                path.push_back(node);
+                path_ends.push_back(j + 1);
+            } else if (state == UTF8_REJECT) {
+                dead_end = j + 1;
+                break;
+            }
+        }
+
+        if ((dead_end == SIZE_MAX) && (state == UTF8_ACCEPT)) {
+            found[i] = frozen->is_final(node);
         }
     }
+}
 
-    return TPrefixState(prefix, prev_state);
+uint32_t Dawg::ordinal(std::string_view word) const
+{
+    TStateIndex node = frozen->get_root();
+    uint32_t result = 0;
+
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+    for (char c: word) {
+        state = decode(&state, &codepoint, static_cast<unsigned char>(c));
+        if (state == UTF8_ACCEPT) {
+            const FrozenEdge *it = frozen->find_edge(node, codepoint);
+            if (!it) {
+                return FrozenDawg::NO_ORDINAL;
+            }
+
+            result += frozen->get_rank(node, it);
+            node = it->target;
+        } else if (state == UTF8_REJECT) {
+            return FrozenDawg::NO_ORDINAL;
+        }
+    }
+
+    return ((state == UTF8_ACCEPT) && frozen->is_final(node)) ? result : FrozenDawg::NO_ORDINAL;
 }
 
-inline Builder::Builder(bool root_final):
-    dawg(root_final)
+std::string Dawg::word_at(uint32_t ordinal) const
 {
+    char buf[5];
+
+    TStateIndex node = frozen->get_root();
+    if (ordinal >= frozen->get_word_count(node)) {
+        throw std::runtime_error("ordinal out of range");
+    }
+
+    std::string word;
+    while (!frozen->is_final(node) || ordinal) {
+        // the first edge whose words reach past ordinal
+        const FrozenEdge *it = std::upper_bound(
+            frozen->begin(node), frozen->end(node), ordinal, [](uint32_t o, const FrozenEdge &edge) {
+                return o < edge.rank; });
+        assert(it != frozen->end(node));
+        ordinal -= frozen->get_rank(node, it);
+        size_t l = utf8_encode(buf, it->letter);
+        assert(l);
+        word.append(buf, l);
+        node = it->target;
+    }
+
+    return word;
+}
+
+inline Register::Slot::Slot():
+    hash(0),
+    state(FrozenDawg::NO_STATE)
+{
+}
+
+Register::Register():
+    slots(1024),
+    count(0),
+    live_size(0)
+{
+    states.emplace_back(false, 0);
+}
+
+inline bool Register::is_final(TStateIndex state) const
+{
+    return states[state].is_final();
+}
+
+inline const FrozenEdge *Register::begin(TStateIndex state) const
+{
+    return edges.data() + states[state].get_first_edge();
+}
+
+inline const FrozenEdge *Register::end(TStateIndex state) const
+{
+    return edges.data() + states[state + 1].get_first_edge();
+}
+
+TStateIndex Register::get_child(TStateIndex state, uint32_t letter) const
+{
+    const FrozenEdge *e = end(state);
+    const FrozenEdge *it = std::lower_bound(
+        begin(state), e, letter, [](const FrozenEdge &edge, uint32_t l) {
+            return edge.letter < l; });
+
+    return ((it == e) || (it->letter != letter)) ? FrozenDawg::NO_STATE : it->target;
+}
+
+uint32_t Register::get_word_count(TStateIndex state) const
+{
+    const FrozenEdge *e = end(state);
+    return (begin(state) == e) ? is_final(state) : (e - 1)->rank;
 }
 
-void Builder::build(const TWords &words)
+bool Register::is_dead(TStateIndex state) const
 {
-    for (auto &word: words) {
-        Dawg::TPrefixState prefix_state = dawg.track_prefix(word);
-        assert(prefix_state.second.get());
-        std::string current_suffix(word.begin() + prefix_state.first.size(), word.end());
-        if (prefix_state.second->has_children()) {
-            replace_or_register(prefix_state.second);
+    return !is_final(state) && (begin(state) == end(state));
+}
+
+TStateIndex Register::intern(bool finl, const FrozenEdge *begin, const FrozenEdge *end)
+{
+    if (2 * (count + 1) > slots.size()) {
+        grow();
+    }
+
+    size_t h = hash_state(finl, begin, end);
+    size_t mask = slots.size() - 1;
+    size_t i = hash_finish(h) & mask;
+    while (slots[i].state != FrozenDawg::NO_STATE) {
+        if ((slots[i].hash == h) && equals(slots[i].state, finl, begin, end)) {
+            return slots[i].state;
         }
 
-        add_suffix(prefix_state.second, current_suffix);
+        i = (i + 1) & mask;
+    }
+
+    if ((states.size() >= FrozenDawg::NO_STATE) || (edges.size() + (end - begin) >= 0x80000000)) {
+        throw std::runtime_error("dictionary too big");
     }
 
-    replace_or_register(dawg.root);
+    // the sentinel becomes the new state
+    TStateIndex index = states.size() - 1;
+    size_t first_edge = edges.size();
+    edges.insert(edges.end(), begin, end);
+    uint64_t rank = finl;
+    for (size_t j = first_edge; j < edges.size(); ++j) {
+        rank += get_word_count(edges[j].target);
+        if (rank >= FrozenDawg::NO_ORDINAL) {
+            edges.erase(edges.begin() + first_edge, edges.end());
+            throw std::runtime_error("too many words");
+        }
+
+        edges[j].rank = rank;
+    }
+
+    states.back() = FrozenState(finl, first_edge);
+    states.emplace_back(false, edges.size());
+
+    slots[i].hash = h;
+    slots[i].state = index;
+    ++count;
+    return index;
 }
 
-void Builder::replace_or_register(DawgStateRef state)
+TStateIndex Register::with_final(TStateIndex state, bool finl)
 {
-    assert(state.get());
-    DawgStateRef child = state->last_child();
-    if (child.get()) {
-        if (child->has_children()) {
-            replace_or_register(child);
+    scratch.assign(begin(state), end(state));
+    return intern(finl, scratch.data(), scratch.data() + scratch.size());
+}
+
+TStateIndex Register::with_edge(TStateIndex state, uint32_t letter, TStateIndex target)
+{
+    scratch.assign(begin(state), end(state));
+    auto it = std::lower_bound(
+        scratch.begin(), scratch.end(), letter, [](const FrozenEdge &edge, uint32_t l) {
+            return edge.letter < l; });
+    if ((it != scratch.end()) && (it->letter == letter)) {
+        if (target == FrozenDawg::NO_STATE) {
+            scratch.erase(it);
+        } else {
+            it->target = target;
         }
+    } else if (target != FrozenDawg::NO_STATE) {
+        scratch.insert(it, FrozenEdge(letter, target));
+    }
 
-        auto it = registr.find(child);
-        if (it != registr.end()) {
-            state->set_last_child(*it);
+    return intern(is_final(state), scratch.data(), scratch.data() + scratch.size());
+}
+
+TStateIndex Register::copy_reachable(const FrozenDawg &source)
+{
+    FrozenDawg::TEdges root_edges;
+    copy_below(source, root_edges);
+    TStateIndex root = intern(source.is_final(source.get_root()), root_edges.data(), root_edges.data() + root_edges.size());
+    live_size = states.size();
+    return root;
+}
+
+void Register::copy_below(const FrozenDawg &source, FrozenDawg::TEdges &root_edges)
+{
+    using TCursor = std::pair<TStateIndex, const FrozenEdge *>;
+
+    std::vector<TStateIndex> translated(source.get_state_count(), FrozenDawg::NO_STATE);
+    std::vector<TCursor> stack;
+    TStateIndex root = source.get_root();
+    stack.emplace_back(root, source.begin(root));
+    while (!stack.empty()) {
+        TStateIndex state = stack.back().first;
+        const FrozenEdge *it = stack.back().second;
+        if (it != source.end(state)) {
+            ++stack.back().second;
+            if (translated[it->target] == FrozenDawg::NO_STATE) {
+                stack.emplace_back(it->target, source.begin(it->target));
+            }
         } else {
-            registr.insert(child);
+            FrozenDawg::TEdges &local = (state == root) ? root_edges : scratch;
+            if (state != root) {
+                local.clear();
+            }
+
+            for (it = source.begin(state); it != source.end(state); ++it) {
+                local.emplace_back(it->letter, translated[it->target]);
+            }
+
+            if (state != root) {
+                translated[state] = intern(source.is_final(state), local.data(), local.data() + local.size());
+            }
+
+            stack.pop_back();
         }
     }
 }
 
-void Builder::add_suffix(const DawgStateRef &state, const std::string &suffix)
+bool Register::needs_compaction() const
 {
-    assert(state.get());
-    const unsigned char *u = reinterpret_cast<const unsigned char *>(suffix.c_str());
+    return states.size() > 2 * live_size + 1024;
+}
 
-    DawgStateRef prev_state = state;
-    uint32_t char_state = UTF8_ACCEPT;
-    uint32_t ch = 0xdeadbeef;
-    while (*u) {
-        while (decode(&char_state, &ch, *u)) {
-            ++u;
+std::shared_ptr<FrozenDawg> Register::freeze(TStateIndex root)
+{
+    auto frozen = std::make_shared<FrozenDawg>(std::move(states), std::move(edges), root);
+    states.clear();
+    edges.clear();
+    TSlots().swap(slots);
+    count = 0;
+    return frozen;
+}
+
+std::shared_ptr<FrozenDawg> Register::make_view(TStateIndex root)
+{
+    return std::make_shared<FrozenDawg>(states.data(), states.size(), edges.data(), edges.size(), root, shared_from_this());
+}
+
+size_t Register::hash_state(bool finl, const FrozenEdge *begin, const FrozenEdge *end)
+{
+    size_t h = finl ? 1 : 0;
+    for (const FrozenEdge *it = begin; it != end; ++it) {
+        h = hash_combine(h, it->letter);
+        h = hash_combine(h, it->target);
+    }
+
+    return h;
+}
+
+bool Register::equals(TStateIndex state, bool finl, const FrozenEdge *begin, const FrozenEdge *end) const
+{
+    if (states[state].is_final() != finl) {
+        return false;
+    }
+
+    const FrozenEdge *b = edges.data() + states[state].get_first_edge();
+    const FrozenEdge *e = edges.data() + states[state + 1].get_first_edge();
+    return std::equal(b, e, begin, end, [](const FrozenEdge &x, const FrozenEdge &y) {
+        return (x.letter == y.letter) && (x.target == y.target); });
+}
+
+void Register::grow()
+{
+    TSlots old(2 * slots.size());
+    old.swap(slots);
+
+    size_t mask = slots.size() - 1;
+    for (const Slot &slot: old) {
+        if (slot.state != FrozenDawg::NO_STATE) {
+            size_t i = hash_finish(slot.hash) & mask;
+            while (slots[i].state != FrozenDawg::NO_STATE) {
+                i = (i + 1) & mask;
+            }
+
+            slots[i] = slot;
         }
+    }
+}
+
+inline StreamingBuilder::Pending::Pending():
+    finl(false)
+{
+}
+
+StreamingBuilder::StreamingBuilder():
+    registr(std::make_unique<Register>()),
+    path(1),
+    path_size(1)
+{
+}
+
+StreamingBuilder::~StreamingBuilder()
+{
+}
+
+void StreamingBuilder::add_lines(std::istream &in)
+{
+    std::string line;
+    while (std::getline(in, line)) {
+        add(line);
+    }
+
+    if (in.bad()) {
+        throw std::runtime_error("cannot read words");
+    }
+}
+
+Dawg StreamingBuilder::finish()
+{
+    minimize(0);
+    const FrozenDawg::TEdges &root_edges = path[0].edges;
+    TStateIndex root = registr->intern(path[0].finl, root_edges.data(), root_edges.data() + root_edges.size());
+    Dawg dawg(registr->freeze(root));
+
+    path.resize(1);
+    path[0].finl = false;
+    path[0].edges.clear();
+    path_size = 1;
+    registr = std::make_unique<Register>();
+    return dawg;
+}
 
-        if (char_state != UTF8_ACCEPT) {
-            throw std::runtime_error("suffix has invalid UTF-8");
+void StreamingBuilder::add(std::string_view word)
+{
+    decode_word(word, letters);
+
+    size_t common = 0;
+    while ((common < letters.size()) && (common + 1 < path_size) &&
+           (path[common].edges.back().letter == letters[common])) {
+        ++common;
+    }
+
+    if (common + 1 < path_size) {
+        if ((common == letters.size()) || (letters[common] < path[common].edges.back().letter)) {
+            throw std::runtime_error("words not sorted");
         }
+    }
 
-        ++u;
+    minimize(common);
+
+    if (common == letters.size()) { // empty or repeated word
+        path[common].finl = true;
+        return;
+    }
+
+    for (size_t i = common; i < letters.size(); ++i) {
+        path[i].edges.emplace_back(letters[i], FrozenDawg::NO_STATE);
+        push_level(i + 1 == letters.size());
+    }
+}
 
-        DawgStateRef next_state = std::make_shared<DawgState>(!*u);
-        prev_state->add_child(ch, next_state);
-        registr.insert(next_state);
-        prev_state = next_state;
+void StreamingBuilder::minimize(size_t depth)
+{
+    while (path_size > depth + 1) {
+        const Pending &top = path[path_size - 1];
+        TStateIndex state = registr->intern(top.finl, top.edges.data(), top.edges.data() + top.edges.size());
+        --path_size;
+        path[path_size - 1].edges.back().target = state;
     }
 }
 
-Dawg make_dawg_impl(TWords &words)
+void StreamingBuilder::push_level(bool finl)
+{
+    if (path.size() == path_size) {
+        path.emplace_back();
+    }
+
+    Pending &level = path[path_size];
+    level.finl = finl;
+    level.edges.clear();
+    ++path_size;
+}
+
+static bool word_less(const std::string &a, const std::string &b)
 {
     // UTF-8 can be compared per-character, but for the ordering to be
     // by Unicode codepoints (which this program requires), the
     // character must be unsigned
-    std::sort(words.begin(), words.end(),
-              [](const std::string &a, const std::string &b) {
-                  return strcmp(a.c_str(), b.c_str()) < 0;
-              });
-
-    Builder builder(words.empty() || words[0].empty());
-    builder.build(words);
-    return builder.dawg;
+    return strcmp(a.c_str(), b.c_str()) < 0;
+}
+
+// the first two bytes of w, zero for the empty word
+static unsigned get_lead_key(const std::string &w)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(w.c_str());
+    return u[0] ? ((u[0] << 8) | u[1]) : 0;
+}
+
+// Orders words by their first two bytes (a counting sort). Words
+// with the same leading letter end up in consecutive groups, but
+// letters of 3 or 4 bytes sharing their first two stay interleaved
+// within a group.
+static void sort_by_lead(TWords &words)
+{
+    std::vector<size_t> offsets(0x10001, 0);
+    for (const std::string &w: words) {
+        ++offsets[get_lead_key(w) + 1];
+    }
+
+    for (size_t i = 1; i < offsets.size(); ++i) {
+        offsets[i] += offsets[i - 1];
+    }
+
+    TWords sorted(words.size());
+    for (std::string &w: words) {
+        sorted[offsets[get_lead_key(w)]++].swap(w);
+    }
+
+    words.swap(sorted);
+}
+
+// Splits words (ordered by sort_by_lead) into ranges of roughly equal
+// size, each starting at a different leading letter (or the empty
+// word), so that the ranges' DAWGs have disjoint root edges. Ranges
+// are cut only between groups of sort_by_lead, where the leading
+// letter changes too.
+static std::vector<size_t> get_shard_bounds(const TWords &words, size_t shard_count)
+{
+    std::vector<size_t> bounds;
+    bounds.push_back(0);
+    for (size_t k = 1; k < shard_count; ++k) {
+        size_t i = std::max(bounds.back() + 1, k * words.size() / shard_count);
+        while ((i < words.size()) && !words[i - 1].empty()) {
+            // UTF-8 letters sharing their first byte have the same
+            // length
+            const std::string &prev = words[i - 1];
+            unsigned char lead = prev[0];
+            size_t len = (lead < 0x80) ? 1 : (lead < 0xe0) ? 2 : (lead < 0xf0) ? 3 : 4;
+            if ((get_lead_key(words[i]) != get_lead_key(prev)) && words[i].compare(0, len, prev, 0, len)) {
+                break;
+            }
+
+            ++i;
+        }
+
+        if (i >= words.size()) {
+            break;
+        }
+
+        bounds.push_back(i);
+    }
+
+    bounds.push_back(words.size());
+    return bounds;
+}
+
+// sorts words and builds shards of them on separate threads
+static Dawg build_parallel(TWords &words, size_t shard_count, unsigned thread_count)
+{
+    sort_by_lead(words);
+    std::vector<size_t> bounds = get_shard_bounds(words, shard_count);
+    shard_count = bounds.size() - 1;
+
+    std::vector<std::promise<Dawg>> promises(shard_count);
+    std::atomic<size_t> next_shard(0);
+    auto work = [&]() {
+        size_t k;
+        while ((k = next_shard++) < shard_count) {
+            try {
+                std::sort(words.begin() + bounds[k], words.begin() + bounds[k + 1], word_less);
+
+                StreamingBuilder builder;
+                for (size_t i = bounds[k]; i < bounds[k + 1]; ++i) {
+                    builder.add(words[i]);
+                }
+
+                promises[k].set_value(builder.finish());
+            } catch (...) {
+                promises[k].set_exception(std::current_exception());
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<size_t>(thread_count, shard_count); ++i) {
+        workers.emplace_back(work);
+    }
+
+    // shards are merged in order as they become available, each
+    // interning its states into the common register
+    Register registr;
+    FrozenDawg::TEdges root_edges;
+    bool root_final = false;
+    std::exception_ptr error;
+    for (size_t k = 0; k < shard_count; ++k) {
+        try {
+            Dawg shard = promises[k].get_future().get();
+            const FrozenDawg &frozen = shard.get_frozen();
+            if (!error) {
+                root_final = root_final || frozen.is_final(frozen.get_root());
+                registr.copy_below(frozen, root_edges);
+            }
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+
+    for (std::thread &worker: workers) {
+        worker.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    TStateIndex root = registr.intern(root_final, root_edges.data(), root_edges.data() + root_edges.size());
+    return Dawg(registr.freeze(root));
+}
+
+Dawg make_dawg_impl(TWords &words, unsigned thread_count)
+{
+    if (!thread_count) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+
+    // a few shards per thread balance the load
+    const size_t MIN_SHARD_SIZE = 16384;
+    size_t shard_count = std::min<size_t>(4 * thread_count, words.size() / MIN_SHARD_SIZE);
+    if ((thread_count > 1) && (shard_count > 1)) {
+        return build_parallel(words, shard_count, thread_count);
+    }
+
+    std::sort(words.begin(), words.end(), word_less);
+
+    StreamingBuilder builder;
+    for (const std::string &word: words) {
+        builder.add(word);
+    }
+
+    return builder.finish();
+}
+
+Dawg make_dawg_from_sorted_file(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+
+    StreamingBuilder builder;
+    builder.add_lines(in);
+    return builder.finish();
 }
 
 }
@@ -2,101 +2,241 @@
 #define mueddi_dawg_hh
 
 #include <iostream>
-#include <map>
 #include <memory>
+#include <span>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
+#include <stdint.h>
 
 namespace mueddi
 {
 
-class DawgState;
-
-class Builder;
-
-using DawgStateRef = std::shared_ptr<DawgState>;
+class Register;
 
 using TWords = std::vector<std::string>;
 
-using TChildren = std::map<uint32_t, DawgStateRef>;
+using TStateIndex = uint32_t;
 
-class DawgState
+class FrozenEdge
 {
 public:
-    DawgState(bool finl);
-    ~DawgState() = default;
-    DawgState(const DawgState &) = delete;
-    DawgState &operator=(const DawgState &) = delete;
+    uint32_t letter;
+    TStateIndex target;
+
+    // number of words in the right language of the source state up to
+    // and including those continuing through this edge; maintained
+    // by the builder
+    uint32_t rank;
 
-    bool operator==(const DawgState &other) const = default;
-    bool operator<(const DawgState &other) const = default;
+    FrozenEdge(uint32_t l, TStateIndex t);
+};
+
+class FrozenState
+{
+public:
+    FrozenState(bool finl, uint32_t first_edge);
 
     bool is_final() const;
 
-    bool has_children() const;
+    uint32_t get_first_edge() const;
+
+private:
+    static constexpr uint32_t FINAL_FLAG = 0x80000000;
+
+    uint32_t packed;
+};
+
+// Immutable DAWG packed into two flat arrays: states (with a sentinel
+// at the end, so the edges of state s are [s.first_edge,
+// (s + 1).first_edge)) and edges sorted by letter within each state.
+// The arrays are either owned, mapped from a file written by save, or
+// borrowed from an owner kept alive by the instance.
+class FrozenDawg
+{
+public:
+    static constexpr TStateIndex NO_STATE = UINT32_MAX;
+    static constexpr uint32_t NO_ORDINAL = UINT32_MAX;
+
+    using TStates = std::vector<FrozenState>;
+    using TEdges = std::vector<FrozenEdge>;
+
+    FrozenDawg(TStates &&states, TEdges &&edges, TStateIndex root);
+    explicit FrozenDawg(const std::string &path);
+    FrozenDawg(const FrozenState *states, size_t state_size, const FrozenEdge *edges, size_t edge_size, TStateIndex root, const std::shared_ptr<const void> &owner);
+    ~FrozenDawg();
+    FrozenDawg(const FrozenDawg &) = delete;
+    FrozenDawg &operator=(const FrozenDawg &) = delete;
+
+    TStateIndex get_root() const;
+
+    size_t get_state_count() const;
+
+    size_t get_edge_count() const;
+
+    bool is_final(TStateIndex state) const;
+
+    const FrozenEdge *begin(TStateIndex state) const;
+    const FrozenEdge *end(TStateIndex state) const;
 
-    TChildren::const_iterator begin() const;
-    TChildren::const_iterator end() const;
+    // nullptr if state has no edge for letter
+    const FrozenEdge *find_edge(TStateIndex state, uint32_t letter) const;
 
-    DawgStateRef get_child(uint32_t letter);
+    TStateIndex get_child(TStateIndex state, uint32_t letter) const;
 
-    DawgStateRef last_child();
+    // number of words in the right language of state
+    uint32_t get_word_count(TStateIndex state) const;
 
-    void set_last_child(const DawgStateRef &child);
+    // number of words in the right language of state which sort
+    // before those continuing through edge
+    uint32_t get_rank(TStateIndex state, const FrozenEdge *edge) const;
 
-    void add_child(uint32_t letter, const DawgStateRef &child);
+    // hint that the entry of state will be read soon
+    void prefetch(TStateIndex state) const;
 
-    void dump(std::ostream &os) const;
+    // hint that the edges of state will be read soon; reads the entry
+    // of state, which should be cached by then
+    void prefetch_edges(TStateIndex state) const;
+
+    void dump(std::ostream &os, TStateIndex state) const;
+
+    // writes a temporary file in the directory of path and renames it
+    // to path
+    void save(const std::string &path) const;
 
 private:
-    const bool finl;
-    TChildren children;
-};
+    class MappedFile;
 
-inline std::ostream &operator<<(std::ostream &os, const DawgStateRef &ref)
-{
-    const DawgState *state = ref.get();
-    if (state) {
-        state->dump(os);
-    } else {
-        os << "<null>";
-    }
+    TStates own_states;
+    TEdges own_edges;
+    std::shared_ptr<const void> owner;
 
-    return os;
-}
+    const FrozenState *states;
+    size_t state_size; // including the sentinel
+    const FrozenEdge *edges;
+    size_t edge_size;
+    TStateIndex root;
+};
 
 class Dawg
 {
 public:
     Dawg(bool root_final);
+    explicit Dawg(const std::shared_ptr<const FrozenDawg> &frozen);
     Dawg(const Dawg &other);
     ~Dawg();
     Dawg &operator=(const Dawg &other);
     Dawg(Dawg &&other) = default;
     Dawg& operator=(Dawg &&other) = default;
 
-    bool accepts(const std::string &w);
+    // throws on invalid UTF-8
+    bool accepts(const std::string &w) const;
+
+    // like accepts, but doesn't allocate and returns false for
+    // invalid UTF-8
+    bool contains(std::string_view word) const;
+
+    // sets found[i] to contains(words[i]); words are looked up in
+    // sorted order, so that a prefix shared by neighbours is walked
+    // once
+    void contains_many(std::span<const std::string_view> words, std::vector<bool> &found) const;
+
+    uint32_t get_word_count() const;
+
+    // position of word among the accepted words in (codepoint) order,
+    // or FrozenDawg::NO_ORDINAL if it isn't accepted
+    uint32_t ordinal(std::string_view word) const;
 
-    DawgStateRef get_root() const;
+    // inverse of ordinal; throws for ordinals out of range
+    std::string word_at(uint32_t ordinal) const;
+
+    // Both keep the automaton minimal and return whether it changed.
+    // Their cost is proportional to the word length and the fan-out
+    // along its path, plus (amortized) an occasional compaction; the
+    // first modification of a built, copied or mapped Dawg copies its
+    // arrays. Modifications don't affect copies of the Dawg.
+    bool insert(const std::string &word);
+    bool erase(const std::string &word);
+
+    const FrozenDawg &get_frozen() const;
+
+    void save(const std::string &path) const;
+
+    // Maps a file written by save. The file must not be modified in
+    // place while the returned Dawg (or any of its copies) exists;
+    // save replaces it with a new file instead. Opening reads all of
+    // the file to check its indices, letter order and ranks.
+    static Dawg open_mmap(const std::string &path);
 
 private:
-    friend class Builder;
+    TStateIndex detach();
 
-    using TPrefixState = std::pair<std::string, DawgStateRef>;
+    void attach(TStateIndex root);
 
-    DawgStateRef root;
+    std::shared_ptr<const FrozenDawg> frozen;
 
-    TPrefixState track_prefix(const std::string &word);
+    // present after the first modification; frozen is then a view
+    // of its arrays
+    std::shared_ptr<Register> registr;
 };
 
 inline std::ostream &operator<<(std::ostream &os, const Dawg &dawg)
 {
-    os << "Dawg: " << dawg.get_root();
+    const FrozenDawg &frozen = dawg.get_frozen();
+    os << "Dawg: ";
+    frozen.dump(os, frozen.get_root());
     return os;
 }
 
-Dawg make_dawg_impl(TWords &words); // param modified in-place
+// Builds a DAWG from words added in sorted order (the algorithm of
+// Daciuk et al.), holding only the minimized states plus the path of
+// the last word. Repeated words are ignored; unsorted ones throw.
+class StreamingBuilder
+{
+public:
+    StreamingBuilder();
+    ~StreamingBuilder();
+    StreamingBuilder(const StreamingBuilder &) = delete;
+    StreamingBuilder &operator=(const StreamingBuilder &) = delete;
+
+    void add(std::string_view word);
+
+    // adds each line as a word
+    void add_lines(std::istream &in);
+
+    // the builder can be reused afterwards
+    Dawg finish();
+
+private:
+    class Pending
+    {
+    public:
+        bool finl;
+        FrozenDawg::TEdges edges;
+
+        Pending();
+    };
+
+    using TPath = std::vector<Pending>;
+
+    // registers pending states deeper than depth
+    void minimize(size_t depth);
+
+    void push_level(bool finl);
+
+    std::unique_ptr<Register> registr;
+    TPath path; // states on the path of the last word, not minimized yet
+    size_t path_size; // path[0] is the root
+    std::vector<uint32_t> letters;
+};
+
+// the file has one word per line, sorted
+Dawg make_dawg_from_sorted_file(const std::string &path);
+
+// param modified in-place; with more than one thread (by default one
+// per core), big inputs are built in shards which are then merged
+Dawg make_dawg_impl(TWords &words, unsigned thread_count = 0);
 
 template<typename I>
 Dawg make_dawg(I b, I e)
@@ -111,34 +251,89 @@ Dawg make_dawg(const R &c)
     return make_dawg(std::begin(c), std::end(c));
 }
 
-inline DawgState::DawgState(bool finl):
-    finl(finl)
+inline FrozenEdge::FrozenEdge(uint32_t l, TStateIndex t):
+    letter(l),
+    target(t),
+    rank(0)
 {
 }
 
-inline bool DawgState::is_final() const
+inline FrozenState::FrozenState(bool finl, uint32_t first_edge):
+    packed(finl ? (first_edge | FINAL_FLAG) : first_edge)
 {
-    return finl;
 }
 
-inline bool DawgState::has_children() const
+inline bool FrozenState::is_final() const
 {
-    return !children.empty();
+    return packed & FINAL_FLAG;
 }
 
-inline TChildren::const_iterator DawgState::begin() const
+inline uint32_t FrozenState::get_first_edge() const
 {
-    return children.begin();
+    return packed & ~FINAL_FLAG;
 }
 
-inline TChildren::const_iterator DawgState::end() const
+inline TStateIndex FrozenDawg::get_root() const
 {
-    return children.end();
+    return root;
 }
 
-inline DawgStateRef Dawg::get_root() const
+inline size_t FrozenDawg::get_state_count() const
 {
-    return root;
+    return state_size - 1;
+}
+
+inline size_t FrozenDawg::get_edge_count() const
+{
+    return edge_size;
+}
+
+inline bool FrozenDawg::is_final(TStateIndex state) const
+{
+    return states[state].is_final();
+}
+
+inline const FrozenEdge *FrozenDawg::begin(TStateIndex state) const
+{
+    return edges + states[state].get_first_edge();
+}
+
+inline const FrozenEdge *FrozenDawg::end(TStateIndex state) const
+{
+    return edges + states[state + 1].get_first_edge();
+}
+
+inline uint32_t FrozenDawg::get_word_count(TStateIndex state) const
+{
+    const FrozenEdge *e = end(state);
+    return (begin(state) == e) ? is_final(state) : (e - 1)->rank;
+}
+
+inline uint32_t FrozenDawg::get_rank(TStateIndex state, const FrozenEdge *edge) const
+{
+    return (edge == begin(state)) ? is_final(state) : (edge - 1)->rank;
+}
+
+inline void FrozenDawg::prefetch(TStateIndex state) const
+{
+    // the entry after it (bounding the edges) is usually on the same
+    // cache line
+    __builtin_prefetch(states + state);
+}
+
+inline void FrozenDawg::prefetch_edges(TStateIndex state) const
+{
+    __builtin_prefetch(begin(state));
+}
+
+inline const FrozenDawg &Dawg::get_frozen() const
+{
+    return *frozen;
+}
+
+inline uint32_t Dawg::get_word_count() const
+{
+    return frozen->get_word_count(frozen->get_root());
 }
 
 }
@@ -0,0 +1,105 @@
+// Generates the complete universal automaton tables for small n, so
+// that queries at these tolerances never compute transitions lazily.
+
+#include "leven.hh"
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <stdlib.h>
+
+namespace mueddi
+{
+
+// the generator itself starts from empty tables
+const GeneratedTable *const generated_tables = nullptr;
+const size_t generated_table_count = 0;
+
+static const size_t MAX_GENERATED_N = 3;
+
+template<typename T>
+static void write_array(std::ostream &os, const char *type, const char *name, size_t n, const std::vector<T> &values)
+{
+    os << "static const " << type << ' ' << name << '_' << n << "[] = {";
+    for (size_t i = 0; i < values.size(); ++i) {
+        os << ((i % 16) ? " " : "\n    ") << values[i] << ',';
+    }
+
+    os << "\n};\n\n";
+}
+
+// returns the number of states
+static size_t generate(std::ostream &os, size_t n)
+{
+    LazyTable table(n);
+    std::vector<uint32_t> position_starts;
+    std::vector<short> positions;
+    std::vector<uint32_t> transitions;
+
+    // the state count grows while rows are filled
+    for (uint32_t id = 0; id < table.get_state_count(); ++id) {
+        position_starts.push_back(positions.size() / 2);
+        for (const RelPos &rp: table.get_reduced_union(id)) {
+            positions.push_back(rp.offset);
+            positions.push_back(rp.edit);
+        }
+
+        for (size_t size = 0; size <= 2 * n + 1; ++size) {
+            for (uint32_t bits = 0; bits < (uint32_t(1) << size); ++bits) {
+                transitions.push_back(table.delta(id, CharVec(bits, size)));
+            }
+        }
+    }
+
+    position_starts.push_back(positions.size() / 2);
+
+    write_array(os, "uint32_t", "position_starts", n, position_starts);
+    write_array(os, "short", "positions", n, positions);
+    write_array(os, "uint32_t", "transitions", n, transitions);
+    return position_starts.size() - 1;
+}
+
+}
+
+using namespace mueddi;
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        std::cerr << "usage: " << *argv << " output" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        std::ofstream os(argv[1]);
+        os << "// generated by gen_tables - do not edit\n\n";
+        os << "#include \"leven.hh\"\n\n";
+        os << "namespace mueddi\n{\n\n";
+
+        std::vector<size_t> state_counts;
+        for (size_t n = 1; n <= MAX_GENERATED_N; ++n) {
+            state_counts.push_back(generate(os, n));
+        }
+
+        os << "static const GeneratedTable tables[] = {\n";
+        for (size_t n = 1; n <= MAX_GENERATED_N; ++n) {
+            os << "    { " << n << ", " << state_counts[n - 1] << ", position_starts_" << n << ", positions_" << n << ", transitions_" << n << " },\n";
+        }
+
+        os << "};\n\n";
+        os << "const GeneratedTable *const generated_tables = tables;\n";
+        os << "const size_t generated_table_count = " << MAX_GENERATED_N << ";\n\n";
+        os << "}\n";
+
+        os.close();
+        if (!os) {
+            throw std::runtime_error("cannot write output");
+        }
+    } catch (std::exception &x) {
+        std::cerr << x.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
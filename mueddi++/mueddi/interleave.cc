@@ -0,0 +1,286 @@
+#include "mueddi.hh"
+#include "encoder.hh"
+#include "leven.hh"
+#include "wide.hh"
+
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace mueddi
+{
+
+// A suspended search, resumed by the scheduler of search_interleaved.
+class SearchTask
+{
+public:
+    class promise_type
+    {
+    public:
+        std::exception_ptr error;
+
+        SearchTask get_return_object();
+
+        // the scheduler starts the search
+        std::suspend_always initial_suspend() noexcept;
+
+        // keeps the frame for resume to check error
+        std::suspend_always final_suspend() noexcept;
+
+        void return_void();
+
+        void unhandled_exception();
+    };
+
+    using THandle = std::coroutine_handle<promise_type>;
+
+    SearchTask();
+    explicit SearchTask(THandle h);
+    ~SearchTask();
+    SearchTask(SearchTask &&other);
+    SearchTask &operator=(SearchTask &&other);
+    SearchTask(const SearchTask &) = delete;
+    SearchTask &operator=(const SearchTask &) = delete;
+
+    // runs the search until it next yields; false (or the exception
+    // it threw) once it has finished
+    bool resume();
+
+private:
+    THandle handle;
+};
+
+// A state on the path of the candidate of an interleaved search.
+class InterleavedFrame
+{
+public:
+    TStateIndex dawg_state;
+    uint32_t ordinal; // of the first word with candidate as prefix
+    LevenState leven_state;
+    LevenState foreign;
+    size_t cursor;
+    size_t stop;
+    size_t length; // of the candidate in bytes
+
+    // of the facade (for WideFacade) before the frame was entered
+    size_t state_mark;
+
+    InterleavedFrame(TStateIndex q, uint32_t o, const LevenState &m, size_t s, size_t l);
+};
+
+inline SearchTask SearchTask::promise_type::get_return_object()
+{
+    return SearchTask(THandle::from_promise(*this));
+}
+
+inline std::suspend_always SearchTask::promise_type::initial_suspend() noexcept
+{
+    return std::suspend_always();
+}
+
+inline std::suspend_always SearchTask::promise_type::final_suspend() noexcept
+{
+    return std::suspend_always();
+}
+
+inline void SearchTask::promise_type::return_void()
+{
+}
+
+inline void SearchTask::promise_type::unhandled_exception()
+{
+    error = std::current_exception();
+}
+
+inline SearchTask::SearchTask():
+    handle(nullptr)
+{
+}
+
+inline SearchTask::SearchTask(THandle h):
+    handle(h)
+{
+}
+
+SearchTask::~SearchTask()
+{
+    if (handle) {
+        handle.destroy();
+    }
+}
+
+SearchTask::SearchTask(SearchTask &&other):
+    handle(std::exchange(other.handle, nullptr))
+{
+}
+
+SearchTask &SearchTask::operator=(SearchTask &&other)
+{
+    if (this != &other) {
+        if (handle) {
+            handle.destroy();
+        }
+
+        handle = std::exchange(other.handle, nullptr);
+    }
+
+    return *this;
+}
+
+bool SearchTask::resume()
+{
+    handle.resume();
+    if (!handle.done()) {
+        return true;
+    }
+
+    if (handle.promise().error) {
+        std::rethrow_exception(handle.promise().error);
+    }
+
+    return false;
+}
+
+inline InterleavedFrame::InterleavedFrame(TStateIndex q, uint32_t o, const LevenState &m, size_t s, size_t l):
+    dawg_state(q),
+    ordinal(o),
+    leven_state(m),
+    foreign(m),
+    cursor(0),
+    stop(s),
+    length(l),
+    state_mark(0)
+{
+}
+
+// Searches depth-first, like the lexicographic InputIterator, but
+// before reading a state, prefetches it and yields, so that other
+// searches run while it loads.
+template<typename F>
+static SearchTask search_coroutine(const FrozenDawg &frozen, F facade, size_t index, ResultSink &sink)
+{
+    std::vector<InterleavedFrame> stack;
+    std::string current;
+    TStateIndex q = frozen.get_root();
+    uint32_t ordinal = 0;
+    LevenState m = F::initial_state();
+    char buf[5];
+    for (;;) {
+        // the entry of q, then its edges, are dependent loads
+        frozen.prefetch(q);
+        co_await std::suspend_always();
+        frozen.prefetch_edges(q);
+        co_await std::suspend_always();
+
+        if (frozen.is_final(q) && facade.is_final(m)) {
+            sink.add(index, current, ordinal);
+        }
+
+        size_t fan_out = frozen.end(q) - frozen.begin(q);
+        if (fan_out) {
+            InterleavedFrame frame(q, ordinal, m, fan_out, current.size());
+            if constexpr (std::is_same_v<F, WideFacade>) {
+                frame.state_mark = facade.get_state_count();
+            }
+
+            // all letters not in the window lead to the same state
+            frame.foreign = facade.delta_foreign(m);
+            stack.push_back(frame);
+        }
+
+        // finds the next child to enter
+        bool found = false;
+        while (!found && !stack.empty()) {
+            InterleavedFrame &top = stack.back();
+            if (top.cursor == top.stop) {
+                if constexpr (std::is_same_v<F, WideFacade>) {
+                    facade.truncate(top.state_mark);
+                }
+
+                stack.pop_back();
+                continue;
+            }
+
+            const FrozenEdge *it = frozen.begin(top.dawg_state) + top.cursor++;
+            LevenState mp = facade.has_letter(it->letter) ? facade.delta(top.leven_state, it->letter) : top.foreign;
+            if (mp.is_dead()) {
+                continue;
+            }
+
+            current.resize(top.length);
+            current.append(buf, utf8_encode(buf, it->letter));
+            q = it->target;
+            ordinal = top.ordinal + frozen.get_rank(top.dawg_state, it);
+            m = mp;
+            found = true;
+        }
+
+        if (!found) {
+            break;
+        }
+    }
+
+    sink.done(index);
+}
+
+static SearchTask start_search(const FrozenDawg &frozen, const Query &query, size_t index, ResultSink &sink)
+{
+    switch (query.n) {
+    case 1:
+        return search_coroutine(frozen, BasicFacade<1>(query.word), index, sink);
+    case 2:
+        return search_coroutine(frozen, BasicFacade<2>(query.word), index, sink);
+    case 3:
+        return search_coroutine(frozen, BasicFacade<3>(query.word), index, sink);
+    case 4:
+        return search_coroutine(frozen, BasicFacade<4>(query.word), index, sink);
+    default:
+        if (query.n > MAX_N) {
+            return search_coroutine(frozen, WideFacade(query.word, query.n), index, sink);
+        }
+
+        return search_coroutine(frozen, Facade(query.word, query.n), index, sink);
+    }
+}
+
+void search_interleaved(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, size_t width)
+{
+    if (!width) {
+        throw std::runtime_error("no searches to interleave");
+    }
+
+    // round-robin over the running searches, each replaced by the next
+    // query once it finishes
+    const FrozenDawg &frozen = dawg.get_frozen();
+    std::vector<SearchTask> running;
+    size_t next = 0;
+    while ((next < queries.size()) && (running.size() < width)) {
+        running.push_back(start_search(frozen, queries[next], next, sink));
+        ++next;
+    }
+
+    size_t i = 0;
+    while (!running.empty()) {
+        if (i >= running.size()) {
+            i = 0;
+        }
+
+        if (running[i].resume()) {
+            ++i;
+        } else if (next < queries.size()) {
+            running[i] = start_search(frozen, queries[next], next, sink);
+            ++next;
+            ++i;
+        } else {
+            running[i] = std::move(running.back());
+            running.pop_back();
+        }
+    }
+}
+
+}
@@ -6,6 +6,7 @@
 #include <stdexcept>
 #include <utility>
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -15,14 +16,6 @@ namespace mueddi
 uint32_t CharVec::power_mask[MAX_LEN];
 CharVec::Initializer char_vec_init;
 
-Facade::TCacheMap Facade::cache;
-
-bool RelPos::subsumes(const RelPos &other) const
-{
-    short r = other.edit - edit;
-    return (r <= 0) ? false : abs(other.offset - offset) <= r;
-}
-
 CharVec::Initializer::Initializer()
 {
     uint32_t pwr = 1;
@@ -56,92 +49,99 @@ void CharVec::dump(std::ostream &os) const
 
 size_t ReducedUnion::hash() const
 {
-    if (!payload->cached_hash) {
-        payload->cached_hash = hash_list(payload->pos_list);
+    size_t h = row_count;
+    for (size_t e = 0; e < row_count; ++e) {
+        h = hash_combine(h, rows[e]);
     }
 
-    return payload->cached_hash;
+    return hash_finish(h);
 }
 
 short ReducedUnion::get_raise_level() const
 {
-    TPositions::const_iterator it = std::min_element(
-        begin(), end(), [](const RelPos &a, const RelPos &b) {
-            return a.offset < b.offset; });
+    TMask all = 0;
+    for (size_t e = 0; e < row_count; ++e) {
+        all |= rows[e];
+    }
 
-    return (it == end()) ? 0 : it->offset;
+    return all ? std::countr_zero(all) : 0;
 }
 
 void ReducedUnion::add(const RelPos &rel_pos)
 {
-    TPositions::iterator nit = std::lower_bound(
-        payload->pos_list.begin(), payload->pos_list.end(), rel_pos);
+    add_unchecked(rel_pos);
+    reduce();
+}
 
-    if ((nit != payload->pos_list.end()) && (rel_pos == *nit)) {
-        return;
-    }
+void ReducedUnion::add_unchecked(const RelPos &rel_pos)
+{
+    assert((rel_pos.offset >= 0) && (static_cast<size_t>(rel_pos.offset) <= MAX_OFFSET));
+    assert((rel_pos.edit >= 0) && (static_cast<size_t>(rel_pos.edit) <= MAX_N));
 
-    for (TPositions::iterator it = payload->pos_list.begin(); it != nit; ++it) {
-        if (it->subsumes(rel_pos)) {
-            return;
-        }
+    size_t e = rel_pos.edit;
+    while (row_count <= e) {
+        rows[row_count++] = 0;
     }
 
-    payload->cached_hash = 0;
-    TPositions::iterator it = payload->pos_list.insert(nit, rel_pos);
+    rows[e] |= TMask(1) << rel_pos.offset;
+}
 
-    assert(it != payload->pos_list.end());
-    ++it;
+void ReducedUnion::update(const ReducedUnion &other)
+{
+    size_t e = 0;
+    for (; e < std::min(row_count, other.row_count); ++e) {
+        rows[e] |= other.rows[e];
+    }
 
-    while (it != payload->pos_list.end()) {
-        if (rel_pos.subsumes(*it)) {
-            it = payload->pos_list.erase(it);
-        } else {
-            ++it;
-        }
+    for (; e < other.row_count; ++e) {
+        rows[e] = other.rows[e];
     }
-}
 
-void ReducedUnion::add_unchecked(const RelPos &rel_pos)
-{
-    TPositions::iterator nit = std::lower_bound(
-        payload->pos_list.begin(), payload->pos_list.end(), rel_pos);
-    assert((nit == payload->pos_list.end()) || (rel_pos != *nit));
-    payload->pos_list.insert(nit, rel_pos);
+    row_count = std::max(row_count, other.row_count);
+    reduce();
 }
 
-void ReducedUnion::update(const ReducedUnion &other)
+ReducedUnion ReducedUnion::subtract(short di) const
 {
-    for (const RelPos &rp: other) {
-        add(rp);
+    assert(di >= 0);
+
+    ReducedUnion red_un;
+    red_un.row_count = row_count;
+    for (size_t e = 0; e < row_count; ++e) {
+        red_un.rows[e] = rows[e] >> di;
     }
+
+    return red_un;
 }
 
-ReducedUnion ReducedUnion::subtract(short di) const
+void ReducedUnion::reduce()
 {
-    ReducedUnion red_un = ReducedUnion();
-    for (RelPos rp: payload->pos_list) {
-        red_un.payload->pos_list.push_back(rp.subtract(di));
+    // (o, e) subsumes (o', e') iff e < e' and |o' - o| <= e' - e, so
+    // the positions subsumed at edit e + 1 are those at or next to
+    // the ones present or subsumed at edit e
+    TMask subsumed = 0;
+    for (size_t e = 0; e < row_count; ++e) {
+        TMask present = rows[e];
+        rows[e] &= ~subsumed;
+        subsumed |= present;
+        subsumed |= (subsumed << 1) | (subsumed >> 1);
     }
 
-    return red_un;
+    while (row_count && !rows[row_count - 1]) {
+        --row_count;
+    }
 }
 
 void ReducedUnion::dump(std::ostream &os) const
 {
-    Payload *p = payload.get();
-    if (p) {
-        os << "[";
-        std::string delim(" ");
-        for (TPositions::const_iterator i = p->pos_list.begin(); i != p->pos_list.end(); ++i) {
-            os << delim << *i;
-            delim = ", ";
-        }
-
-        os << " ]";
-    } else {
-        os << "<null>";
+    os << "[";
+    std::string delim(" ");
+    for (const RelPos &rp: *this) {
+        os << delim << rp;
+        delim = ", ";
     }
+
+    os << " ]";
 }
 
 ReducedUnion Elementary::elem_delta(size_t i, size_t w, const RelPos &rel_pos, const CharVec &char_vec) const
@@ -202,15 +202,38 @@ ReducedUnion Elementary::deltaII(const RelPos &rel_pos, const CharVec &char_vec)
 
 size_t Elementary::get_rel_pos_len(size_t i, size_t w, short e) const
 {
-    assert(w >= i);
-    return std::min(n - e + 1, w - i);
+    // a position past the end of the word doesn't occur in queries,
+    // but gen_tables enumerates all vectors, including too short ones
+    return (w > i) ? std::min(n - e + 1, w - i) : 0;
 }
 
-LazyTable::LazyTable()
+LazyTable::LazyTable(size_t n):
+    row_size((n <= MAX_DENSE_N) ? (size_t(1) << (2 * n + 2)) - 1 : 0),
+    state_count(0)
 {
+    this->n = n;
+    for (std::atomic<StateInfo *> &segment: segments) {
+        segment.store(nullptr, std::memory_order_relaxed);
+    }
+
     ReducedUnion zero;
     zero.add_unchecked(RelPos(0, 0));
-    state2transition.emplace(zero, TTransitionMap());
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t id = intern(zero);
+    assert(id == INITIAL_ID);
+
+    for (size_t i = 0; i < generated_table_count; ++i) {
+        if (generated_tables[i].n == n) {
+            load(generated_tables[i]);
+        }
+    }
+}
+
+LazyTable::~LazyTable()
+{
+    for (std::atomic<StateInfo *> &segment: segments) {
+        delete[] segment.load(std::memory_order_relaxed);
+    }
 }
 
 size_t LazyTable::get_rel_state_len(size_t i, size_t w) const
@@ -219,88 +242,180 @@ size_t LazyTable::get_rel_state_len(size_t i, size_t w) const
     return std::min(2 * n + 1, w - i);
 }
 
-ReducedUnion LazyTable::delta(const LevenState &pinned_state, size_t w, const CharVec &char_vec)
+size_t LazyTable::get_state_count()
 {
-    size_t i = pinned_state.base;
-    TTransitionMap &transition = state2transition[pinned_state.reduced_union];
-    auto p = transition.emplace(char_vec, ReducedUnion());
-    TTransitionMap::iterator redit = p.first;
-    if (p.second) {
-        for (const RelPos &rp: pinned_state.reduced_union) {
-            redit->second.update(elem_delta(i, w, rp, char_vec));
+    std::lock_guard<std::mutex> lock(mutex);
+    return state_count;
+}
+
+LazyTable::TTransition LazyTable::delta(uint32_t id, const CharVec &char_vec)
+{
+    const StateInfo &info = get_info(id);
+    size_t index = get_cv_index(char_vec);
+    uint64_t key = 0;
+    if (info.row) {
+        assert(index < row_size);
+        TTransition transition = info.row[index].load(std::memory_order_acquire);
+        if (transition != UNKNOWN) {
+            return transition;
+        }
+    } else {
+        key = (static_cast<uint64_t>(id) << 32) | index;
+        const TTransition *found = sparse.find(key);
+        if (found) {
+            return *found;
         }
     }
 
-    return redit->second;
+    // the image depends only on the union and the vector, so it's
+    // computed for the shortest word admitting the vector
+    ReducedUnion image;
+    for (const RelPos &rp: info.reduced_union) {
+        image.update(elem_delta(0, char_vec.size, rp, char_vec));
+    }
+
+    TTransition transition = DEAD;
+    if (!image.is_empty()) {
+        short di = image.get_raise_level();
+        ReducedUnion cc = di ? image.subtract(di) : image;
+        std::lock_guard<std::mutex> lock(mutex);
+        transition = (intern(cc) << 8) | di;
+    }
+
+    // racing threads store the same value
+    if (info.row) {
+        info.row[index].store(transition, std::memory_order_release);
+    } else {
+        sparse.insert(key, std::move(transition));
+    }
+
+    return transition;
 }
 
-CharVec LazyTable::make_char_vec(const std::string &sub_word, uint32_t letter)
+uint32_t LazyTable::intern(const ReducedUnion &reduced_union)
 {
-#if 0
-    char buf[5];
-    utf8_encode(buf, letter);
-    std::cerr << "enter make_char_vec(\"" << sub_word << "\", '" << buf << "')" << std::endl;
-#endif
+    TIdMap::const_iterator it = ids.find(reduced_union);
+    if (it != ids.end()) {
+        return it->second;
+    }
 
-    const unsigned char *u = reinterpret_cast<const unsigned char *>(sub_word.c_str());
-    uint32_t bits = 0;
-    size_t char_len = 0;
-    uint32_t pwr = 1;
-    uint32_t state = UTF8_ACCEPT;
-    uint32_t codepoint = 0xdeadbeef;
-    while (*u) {
-        while (decode(&state, &codepoint, *u)) {
-            ++u;
-        }
+    if (state_count >= (DEAD >> 8)) {
+        throw std::runtime_error("too many automaton states");
+    }
 
-        ++char_len;
+    uint32_t id = state_count;
+    size_t pos = id + FIRST_SEGMENT_SIZE;
+    size_t k = std::bit_width(pos) - std::bit_width(FIRST_SEGMENT_SIZE);
+    StateInfo *segment = segments[k].load(std::memory_order_relaxed);
+    if (!segment) {
+        segment = new StateInfo[FIRST_SEGMENT_SIZE << k];
+        segments[k].store(segment, std::memory_order_release);
+    }
 
-        assert(state == UTF8_ACCEPT);
+    StateInfo &info = segment[pos - (FIRST_SEGMENT_SIZE << k)];
+    info.reduced_union = reduced_union;
+    info.reach = INT_MIN;
+    for (const RelPos &rp: reduced_union) {
+        info.reach = std::max(info.reach, rp.offset - rp.edit);
+    }
 
-        if (codepoint == letter) {
-            bits |= pwr;
+    if (row_size) {
+        info.row.reset(new std::atomic<TTransition>[row_size]);
+        for (size_t i = 0; i < row_size; ++i) {
+            info.row[i].store(UNKNOWN, std::memory_order_relaxed);
         }
-
-        pwr *= 2;
-        ++u;
     }
 
-    return CharVec(bits, char_len);
+    // the id is published by storing a transition to it, which
+    // happens after this
+    ids.emplace(reduced_union, id);
+    ++state_count;
+    return id;
 }
 
-Facade::Facade(const std::string &word, size_t n):
-    payload(std::make_shared<Payload>(word, get_code_point_count(reinterpret_cast<const unsigned char *>(word.c_str()))))
+void LazyTable::load(const GeneratedTable &generated)
 {
-    if (n > 15) {
-        throw std::runtime_error("number of corrections too big for this package");
+    assert(row_size);
+    for (uint32_t id = 0; id < generated.state_count; ++id) {
+        ReducedUnion reduced_union;
+        for (uint32_t j = generated.position_starts[id]; j < generated.position_starts[id + 1]; ++j) {
+            reduced_union.add_unchecked(RelPos(generated.positions[2 * j], generated.positions[2 * j + 1]));
+        }
+
+        uint32_t got = intern(reduced_union);
+        assert(got == id);
+
+        const StateInfo &info = get_info(got);
+        const uint32_t *transitions = generated.transitions + id * row_size;
+        for (size_t i = 0; i < row_size; ++i) {
+            info.row[i].store(transitions[i], std::memory_order_relaxed);
+        }
+    }
+}
+
+DecodedWord::DecodedWord(const std::string &word)
+{
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+    for (char c: word) {
+        if (decode(&state, &codepoint, static_cast<unsigned char>(c)) == UTF8_ACCEPT) {
+            letters.push_back(codepoint);
+        }
     }
 
-    LazyTable &lt = cache[n];
-    if (!lt.n) {
-        lt.n = n;
+    if (state != UTF8_ACCEPT) {
+        throw std::runtime_error("cannot count invalid UTF-8");
     }
 
-    payload->lazy_table = &lt;
+    w = letters.size();
+    alphabet = letters;
+    std::sort(alphabet.begin(), alphabet.end());
+    alphabet.erase(std::unique(alphabet.begin(), alphabet.end()), alphabet.end());
 }
 
-bool Facade::is_final(const LevenStateRef &state) const
+void DecodedWord::get_distinct_letters(size_t first, size_t last, std::vector<uint32_t> &window) const
 {
-    LevenState *ls = state.get();
-    assert(ls);
+    window.clear();
+    if (first < last) {
+        window.assign(letters.begin() + first, letters.begin() + last);
+    }
 
-    size_t w = payload->w;
-    size_t n = payload->lazy_table->n;
-    for (RelPos rp: ls->reduced_union) {
-        size_t i = ls->base + rp.offset;
-        if ((w + rp.edit) <= (n + i)) {
-            return true;
-        }
+    std::sort(window.begin(), window.end());
+    window.erase(std::unique(window.begin(), window.end()), window.end());
+}
+
+Facade::Payload::Payload(const std::string &word):
+    DecodedWord(word),
+    lazy_table(nullptr)
+{
+    block_count = w / 64 + 2;
+    masks.assign(alphabet.size() * block_count, 0);
+    for (size_t j = 0; j < w; ++j) {
+        size_t k = std::lower_bound(alphabet.begin(), alphabet.end(), letters[j]) - alphabet.begin();
+        masks[k * block_count + j / 64] |= uint64_t(1) << (j % 64);
     }
+}
+
+Facade::Facade(const std::string &word, size_t n):
+    payload(std::make_shared<Payload>(word))
+{
+    if (n > MAX_N) {
+        throw std::runtime_error("number of corrections too big for this package");
+    }
+
+    payload->lazy_table = &get_lazy_table(n);
+}
+
+bool Facade::is_final(const LevenState &state) const
+{
+    assert(!state.is_dead());
 
-    return false;
+    const LazyTable *lazy_table = payload->lazy_table;
+    ptrdiff_t rest = payload->w - state.base;
+    return rest <= static_cast<ptrdiff_t>(lazy_table->n) + lazy_table->get_reach(state.id);
 }
 
-LevenStateRef Facade::delta(const LevenStateRef &cur_state, uint32_t letter)
+LevenState Facade::delta(const LevenState &cur_state, uint32_t letter)
 {
 #if 0
     char buf[5];
@@ -308,53 +423,60 @@ LevenStateRef Facade::delta(const LevenStateRef &cur_state, uint32_t letter)
     std::cerr << "enter Facade.delta(" << cur_state << ", " << buf << ')' << std::endl;
 #endif
 
-    assert(cur_state.get() && !cur_state->reduced_union.get_raise_level());
+    assert(!cur_state.is_dead());
 
     LazyTable *lazy_table = payload->lazy_table;
-    size_t i = cur_state->base;
+    size_t i = cur_state.base;
     size_t rl = lazy_table->get_rel_state_len(i, payload->w);
 
-    const unsigned char *start = nullptr, *u = reinterpret_cast<const unsigned char *>(payload->word.c_str());
-    uint32_t state = UTF8_ACCEPT;
-    uint32_t codepoint = 0xdeadbeef;
-    size_t cnt = 0;
-    while (*u && (cnt < i + rl)) {
-        if (cnt == i) {
-            start = u;
-        }
+    CharVec char_vec(payload->get_bits(letter, i, rl), rl);
+    return make_successor(cur_state, char_vec);
+}
 
-        while (decode(&state, &codepoint, *u)) {
-            ++u;
-        }
+LevenState Facade::delta_foreign(const LevenState &cur_state)
+{
+    assert(!cur_state.is_dead());
 
-        assert(state == UTF8_ACCEPT); // checked in constructor
+    size_t rl = payload->lazy_table->get_rel_state_len(cur_state.base, payload->w);
+    return make_successor(cur_state, CharVec(0, rl));
+}
 
-        ++u;
-        ++cnt;
-    }
+void Facade::get_window_letters(const LevenState &state, std::vector<uint32_t> &window) const
+{
+    assert(!state.is_dead());
 
-    std::string rel_word;
-    if (start) {
-        rel_word.assign(reinterpret_cast<const char *>(start), reinterpret_cast<const char *>(u));
-    }
+    size_t i = state.base;
+    payload->get_distinct_letters(i, i + payload->lazy_table->get_rel_state_len(i, payload->w), window);
+}
 
-    CharVec char_vec = lazy_table->make_char_vec(rel_word, letter);
-    ReducedUnion image = lazy_table->delta(*cur_state, payload->w, char_vec);
-    if (image.is_empty()) {
-        return LevenStateRef();
+LevenState Facade::make_successor(const LevenState &cur_state, const CharVec &char_vec)
+{
+    LazyTable::TTransition transition = payload->lazy_table->delta(cur_state.id, char_vec);
+    if (transition == LazyTable::DEAD) {
+        return LevenState(cur_state.base, LevenState::DEAD_ID);
     }
 
-    short di = image.get_raise_level();
-    ReducedUnion cc = di ? image.subtract(di) : image;
-    return std::make_shared<LevenState>(i + di, cc);
+    return LevenState(cur_state.base + LazyTable::get_raise_level(transition), LazyTable::get_target(transition));
+}
+
+LazyTable &Facade::get_lazy_table(size_t n)
+{
+    // initialization of a local static is thread-safe
+    static const std::vector<std::unique_ptr<LazyTable>> tables = []() {
+        std::vector<std::unique_ptr<LazyTable>> v;
+        for (size_t i = 0; i <= MAX_N; ++i) {
+            v.push_back(std::make_unique<LazyTable>(i));
+        }
+
+        return v;
+    }();
+
+    return *tables[n];
 }
 
-LevenStateRef Facade::initial_state()
+LevenState Facade::initial_state()
 {
-    RelPos zero_pos = RelPos(0, 0);
-    ReducedUnion zero_union = ReducedUnion();
-    zero_union.add_unchecked(zero_pos);
-    return std::make_shared<LevenState>(0, zero_union);
+    return LevenState(0, LazyTable::INITIAL_ID);
 }
 
 }
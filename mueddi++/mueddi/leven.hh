@@ -1,19 +1,30 @@
 #ifndef mueddi_leven_hh
 #define mueddi_leven_hh
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
 #include <iostream>
-#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
+#include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "concurrent_map.hh"
 
 namespace mueddi
 {
 
 static const size_t MAX_LEN = 31;
 
+// maximum number of corrections
+static const size_t MAX_N = 15;
+
 class RelPos
 {
 public:
@@ -28,10 +39,6 @@ public:
     bool operator==(const RelPos &other) const = default;
     bool operator<(const RelPos &other) const;
 
-    size_t hash() const;
-
-    bool subsumes(const RelPos &other) const;
-
     RelPos subtract(short di) const;
 };
 
@@ -84,22 +91,43 @@ inline std::ostream &operator<<(std::ostream &os, const CharVec &cv)
     return os;
 }
 
+// Set of positions none of which subsumes another, packed as one
+// mask of offsets per edit count: bit o of rows[e] is set iff (o, e)
+// is in the set. Offsets are never negative, as the positions of a
+// state only move forward from its base.
 class ReducedUnion
 {
 public:
-    using TPositions = std::vector<RelPos>;
+    using TMask = uint64_t;
+
+    static constexpr size_t MAX_OFFSET = 63;
+
+    // iterates over positions in (edit, offset) order
+    class ConstIterator
+    {
+    public:
+        ConstIterator(const ReducedUnion *u, size_t e);
+
+        bool operator==(const ConstIterator &other) const = default;
+
+        RelPos operator*() const;
+
+        ConstIterator &operator++();
+
+    private:
+        const ReducedUnion *red_un;
+        size_t edit;
+        TMask rest;
+
+        void skip_empty();
+    };
 
     ReducedUnion();
-    ~ReducedUnion() = default;
-    ReducedUnion(const ReducedUnion &other) = default;
-    ReducedUnion &operator=(const ReducedUnion &other) = default;
-    ReducedUnion(ReducedUnion &&other) = default;
-    ReducedUnion& operator=(ReducedUnion &&other) = default;
 
     bool operator==(const ReducedUnion &other) const;
 
-    TPositions::const_iterator begin() const;
-    TPositions::const_iterator end() const;
+    ConstIterator begin() const;
+    ConstIterator end() const;
 
     bool is_empty() const;
 
@@ -118,21 +146,17 @@ public:
     void dump(std::ostream &os) const;
 
 private:
-    class Payload
-    {
-    public:
-        TPositions pos_list;
-        size_t cached_hash;
+    TMask rows[MAX_N + 1];
 
-        Payload();
-        ~Payload() = default;
-        Payload(const Payload &) = delete;
-        Payload &operator=(const Payload &) = delete;
-    };
+    // rows from row_count up are empty
+    size_t row_count;
 
-    std::shared_ptr<Payload> payload;
+    // removes subsumed positions
+    void reduce();
 };
 
+static_assert(std::is_trivially_copyable_v<ReducedUnion>);
+
 }
 
 namespace std
@@ -178,48 +202,163 @@ private:
     size_t get_rel_pos_len(size_t i, size_t w, short e) const;
 };
 
+// A plain value, so that the search doesn't allocate per step.
 class LevenState
 {
 public:
-    const size_t base;
-    const ReducedUnion reduced_union;
+    static constexpr uint32_t DEAD_ID = UINT32_MAX;
+
+    // 32 bits keep the state in 8 bytes
+    uint32_t base;
 
-    LevenState(size_t b, const ReducedUnion &ru);
-    ~LevenState() = default;
-    LevenState(const LevenState &other) = default;
-    LevenState &operator=(const LevenState &other) = default;
+    // of the reduced union in the LazyTable, or DEAD_ID when no word
+    // with the prefix read so far is close enough
+    uint32_t id;
+
+    LevenState(uint32_t b, uint32_t i);
+
+    bool is_dead() const;
 };
 
-using LevenStateRef = std::shared_ptr<LevenState>;
+static_assert(std::is_trivially_copyable_v<LevenState>);
+static_assert(sizeof(LevenState) == 8);
 
-inline std::ostream &operator<<(std::ostream &os, const LevenStateRef &ref)
+inline std::ostream &operator<<(std::ostream &os, const LevenState &state)
 {
-    const LevenState *state = ref.get();
-    if (state) {
-        os << state->base << ": " << state->reduced_union;
+    if (state.is_dead()) {
+        os << "<dead>";
     } else {
-        os << "<null>";
+        os << state.base << ": #" << state.id;
     }
 
     return os;
 }
 
+// Complete transition table of the universal automaton for one n,
+// generated at build time by gen_tables. State id has the positions
+// (offset, edit pairs) [position_starts[id], position_starts[id +
+// 1]) and the row of transitions starting at id * row size.
+class GeneratedTable
+{
+public:
+    size_t n;
+    size_t state_count;
+    const uint32_t *position_starts;
+    const short *positions;
+    const uint32_t *transitions;
+};
+
+extern const GeneratedTable *const generated_tables;
+extern const size_t generated_table_count;
+
+// Transitions of the universal automaton for one n, computed on
+// demand. Its states (reduced unions) are interned into consecutive
+// ids; for small n, their transitions are kept in dense rows indexed
+// by the characteristic vector, otherwise in a hash map. Safe for
+// concurrent use: a computed transition is found without locking.
 class LazyTable : public Elementary
 {
 public:
-    LazyTable();
+    // target id shifted left by 8 bits, ORed with the raise level
+    using TTransition = uint32_t;
+
+    static constexpr TTransition DEAD = UINT32_MAX - 1;
+
+    // not computed yet
+    static constexpr TTransition UNKNOWN = UINT32_MAX;
+
+    // bigger n have no dense rows
+    static constexpr size_t MAX_DENSE_N = 4;
+
+    // of the state { +0#0 }
+    static constexpr uint32_t INITIAL_ID = 0;
+
+    explicit LazyTable(size_t n);
+    ~LazyTable();
+    LazyTable(const LazyTable &) = delete;
+    LazyTable &operator=(const LazyTable &) = delete;
 
     size_t get_rel_state_len(size_t i, size_t w) const;
 
-    ReducedUnion delta(const LevenState &pinned_state, size_t w, const CharVec &char_vec);
+    size_t get_state_count();
+
+    // valid for the lifetime of the table
+    const ReducedUnion &get_reduced_union(uint32_t id) const;
+
+    // maximum of offset - edit over the positions of state id; the
+    // state is final iff w - base <= n + reach
+    int get_reach(uint32_t id) const;
+
+    TTransition delta(uint32_t id, const CharVec &char_vec);
+
+    // lock-free lookup in the dense row of id, for n <= MAX_DENSE_N;
+    // UNKNOWN when delta hasn't computed the transition yet
+    TTransition get_dense(uint32_t id, const CharVec &char_vec) const;
+
+    static uint32_t get_target(TTransition transition);
 
-    static CharVec make_char_vec(const std::string &sub_word, uint32_t letter);
+    static short get_raise_level(TTransition transition);
 
 private:
-    using TTransitionMap = std::map<CharVec, ReducedUnion>;
-    using TLazyMap = std::unordered_map<ReducedUnion, TTransitionMap>;
+    class StateInfo
+    {
+    public:
+        ReducedUnion reduced_union;
+        int reach;
+
+        // transitions, for n <= MAX_DENSE_N
+        std::unique_ptr<std::atomic<TTransition>[]> row;
+
+        StateInfo();
+    };
+
+    using TSparseMap = ConcurrentMap<uint64_t, TTransition>;
+    using TIdMap = std::unordered_map<ReducedUnion, uint32_t>;
+
+    // segment k holds the infos of ids [2^(k + 8) - 256, 2^(k + 9) - 256)
+    static constexpr size_t FIRST_SEGMENT_SIZE = 256;
+    static constexpr size_t MAX_SEGMENTS = 24;
+
+    // index of a characteristic vector among all vectors of at most
+    // its size
+    static size_t get_cv_index(const CharVec &char_vec);
+
+    const StateInfo &get_info(uint32_t id) const;
+
+    // called with the mutex held
+    uint32_t intern(const ReducedUnion &reduced_union);
+
+    void load(const GeneratedTable &generated);
 
-    TLazyMap state2transition;
+    const size_t row_size;
+    std::atomic<StateInfo *> segments[MAX_SEGMENTS];
+    std::mutex mutex;
+    TIdMap ids;
+    size_t state_count;
+    TSparseMap sparse;
+};
+
+// A query word decoded into letters (codepoints), with the lookups
+// on them which Facade and WideFacade share.
+class DecodedWord
+{
+public:
+    std::vector<uint32_t> letters;
+
+    // number of letters
+    size_t w;
+
+    // distinct letters of the word, sorted
+    std::vector<uint32_t> alphabet;
+
+    // throws on invalid UTF-8
+    explicit DecodedWord(const std::string &word);
+
+    // whether letter occurs anywhere in the word
+    bool has_letter(uint32_t letter) const;
+
+    // sorted distinct letters of the word window [first, last)
+    void get_distinct_letters(size_t first, size_t last, std::vector<uint32_t> &window) const;
 };
 
 class Facade
@@ -229,33 +368,83 @@ public:
     Facade(const Facade &other) = default;
     Facade &operator=(const Facade &other) = default;
 
-    bool is_final(const LevenStateRef &state) const;
+    bool is_final(const LevenState &state) const;
 
-    LevenStateRef delta(const LevenStateRef &cur_state, uint32_t letter);
+    LevenState delta(const LevenState &cur_state, uint32_t letter);
 
-    static LevenStateRef initial_state();
+    // the common successor for all letters which don't occur in the
+    // window of cur_state
+    LevenState delta_foreign(const LevenState &cur_state);
 
-private:
-    using TCacheMap = std::map<size_t, LazyTable>;
+    // whether letter occurs anywhere in the word
+    bool has_letter(uint32_t letter) const;
 
-    class Payload
+    // sorted distinct letters of the window of state
+    void get_window_letters(const LevenState &state, std::vector<uint32_t> &window) const;
+
+    static LevenState initial_state();
+
+protected:
+    class Payload : public DecodedWord
     {
     public:
-        const std::string word;
-        const size_t w;
         LazyTable *lazy_table;
 
-        Payload(const std::string &word, size_t w);
+        // bit j of masks[k * block_count + b] is set iff letter 64 * b
+        // + j of the word is alphabet[k]; the last block of each
+        // letter is zero padding
+        std::vector<uint64_t> masks;
+        size_t block_count;
+
+        explicit Payload(const std::string &word);
         ~Payload() = default;
         Payload(const Payload &) = delete;
         Payload &operator=(const Payload &) = delete;
+
+        // positions of letter in the word window [i, i + len), len < 32
+        uint32_t get_bits(uint32_t letter, size_t i, size_t len) const;
     };
 
     std::shared_ptr<Payload> payload;
 
-    static TCacheMap cache;
+private:
+    LevenState make_successor(const LevenState &cur_state, const CharVec &char_vec);
+
+    // shared by all threads
+    static LazyTable &get_lazy_table(size_t n);
+};
+
+// Facade for a tolerance known at compile time, so that window sizes
+// are constants and known transitions are looked up inline. Used
+// through templated search code, it hides the methods of Facade on
+// the hot path.
+template<size_t N>
+class BasicFacade : public Facade
+{
+public:
+    static_assert((N > 0) && (N <= LazyTable::MAX_DENSE_N));
+
+    static constexpr size_t WINDOW = 2 * N + 1;
+
+    explicit BasicFacade(const std::string &word);
+
+    bool is_final(const LevenState &state) const;
+
+    LevenState delta(const LevenState &cur_state, uint32_t letter);
+
+    LevenState delta_foreign(const LevenState &cur_state);
+
+private:
+    size_t get_window_size(size_t i) const;
+
+    LevenState make_successor(const LevenState &cur_state, const CharVec &char_vec);
 };
 
+// constructs F (Facade, BasicFacade<n> or another class with their
+// interface) for word and n
+template<typename F>
+F make_facade(const std::string &word, size_t n);
+
 inline RelPos::RelPos(short o, short e):
     offset(o),
     edit(e)
@@ -267,11 +456,6 @@ inline bool RelPos::operator<(const RelPos &other) const
     return (edit < other.edit) || ((edit == other.edit) && (offset < other.offset));
 }
 
-inline size_t RelPos::hash() const
-{
-    return (MAX_LEN + 1) * offset + edit;
-}
-
 inline RelPos RelPos::subtract(short di) const
 {
     return RelPos(offset - di, edit);
@@ -303,34 +487,57 @@ inline bool CharVec::has_first_bit_set() const
     return bits & 1;
 }
 
-inline ReducedUnion::ReducedUnion():
-    payload(std::make_shared<Payload>())
+inline ReducedUnion::ConstIterator::ConstIterator(const ReducedUnion *u, size_t e):
+    red_un(u),
+    edit(e),
+    rest((e < u->row_count) ? u->rows[e] : 0)
 {
+    skip_empty();
 }
 
-inline bool ReducedUnion::operator==(const ReducedUnion &other) const
+inline RelPos ReducedUnion::ConstIterator::operator*() const
 {
-    return payload->pos_list == other.payload->pos_list;
+    return RelPos(std::countr_zero(rest), edit);
 }
 
-inline ReducedUnion::TPositions::const_iterator ReducedUnion::begin() const
+inline ReducedUnion::ConstIterator &ReducedUnion::ConstIterator::operator++()
 {
-    return payload->pos_list.begin();
+    rest &= rest - 1;
+    skip_empty();
+    return *this;
 }
 
-inline ReducedUnion::TPositions::const_iterator ReducedUnion::end() const
+inline void ReducedUnion::ConstIterator::skip_empty()
 {
-    return payload->pos_list.end();
+    while (!rest && (edit < red_un->row_count)) {
+        ++edit;
+        rest = (edit < red_un->row_count) ? red_un->rows[edit] : 0;
+    }
 }
 
-inline bool ReducedUnion::is_empty() const
+inline ReducedUnion::ReducedUnion():
+    row_count(0)
+{
+}
+
+inline bool ReducedUnion::operator==(const ReducedUnion &other) const
 {
-    return payload->pos_list.empty();
+    return (row_count == other.row_count) && std::equal(rows, rows + row_count, other.rows);
 }
 
-inline ReducedUnion::Payload::Payload():
-    cached_hash(0)
+inline ReducedUnion::ConstIterator ReducedUnion::begin() const
 {
+    return ConstIterator(this, 0);
+}
+
+inline ReducedUnion::ConstIterator ReducedUnion::end() const
+{
+    return ConstIterator(this, row_count);
+}
+
+inline bool ReducedUnion::is_empty() const
+{
+    return !row_count;
 }
 
 inline Elementary::Elementary():
@@ -338,17 +545,148 @@ inline Elementary::Elementary():
 {
 }
 
-inline LevenState::LevenState(size_t b, const ReducedUnion &ru):
+inline LevenState::LevenState(uint32_t b, uint32_t i):
     base(b),
-    reduced_union(ru)
+    id(i)
+{
+}
+
+inline bool LevenState::is_dead() const
+{
+    return id == DEAD_ID;
+}
+
+inline LazyTable::StateInfo::StateInfo():
+    reach(0)
+{
+}
+
+inline const ReducedUnion &LazyTable::get_reduced_union(uint32_t id) const
+{
+    return get_info(id).reduced_union;
+}
+
+inline int LazyTable::get_reach(uint32_t id) const
+{
+    return get_info(id).reach;
+}
+
+inline uint32_t LazyTable::get_target(TTransition transition)
+{
+    return transition >> 8;
+}
+
+inline short LazyTable::get_raise_level(TTransition transition)
+{
+    return transition & 0xff;
+}
+
+inline size_t LazyTable::get_cv_index(const CharVec &char_vec)
+{
+    return (size_t(1) << char_vec.size) - 1 + char_vec.bits;
+}
+
+inline LazyTable::TTransition LazyTable::get_dense(uint32_t id, const CharVec &char_vec) const
+{
+    const StateInfo &info = get_info(id);
+    assert(info.row);
+    return info.row[get_cv_index(char_vec)].load(std::memory_order_acquire);
+}
+
+inline const LazyTable::StateInfo &LazyTable::get_info(uint32_t id) const
 {
+    size_t pos = id + FIRST_SEGMENT_SIZE;
+    size_t k = std::bit_width(pos) - std::bit_width(FIRST_SEGMENT_SIZE);
+    const StateInfo *segment = segments[k].load(std::memory_order_acquire);
+    return segment[pos - (FIRST_SEGMENT_SIZE << k)];
 }
 
-inline Facade::Payload::Payload(const std::string &word, size_t w):
-    word(word),
-    w(w),
-    lazy_table(nullptr)
+inline bool DecodedWord::has_letter(uint32_t letter) const
 {
+    return std::binary_search(alphabet.begin(), alphabet.end(), letter);
+}
+
+inline bool Facade::has_letter(uint32_t letter) const
+{
+    return payload->has_letter(letter);
+}
+
+inline uint32_t Facade::Payload::get_bits(uint32_t letter, size_t i, size_t len) const
+{
+    auto it = std::lower_bound(alphabet.begin(), alphabet.end(), letter);
+    if ((it == alphabet.end()) || (*it != letter)) {
+        return 0;
+    }
+
+    const uint64_t *mask = masks.data() + (it - alphabet.begin()) * block_count;
+    size_t b = i / 64;
+    size_t sh = i % 64;
+    uint64_t bits = mask[b] >> sh;
+    if (sh) {
+        bits |= mask[b + 1] << (64 - sh);
+    }
+
+    return bits & ((uint64_t(1) << len) - 1);
+}
+
+template<size_t N>
+BasicFacade<N>::BasicFacade(const std::string &word):
+    Facade(word, N)
+{
+}
+
+template<size_t N>
+inline bool BasicFacade<N>::is_final(const LevenState &state) const
+{
+    ptrdiff_t rest = payload->w - state.base;
+    return rest <= static_cast<ptrdiff_t>(N) + payload->lazy_table->get_reach(state.id);
+}
+
+template<size_t N>
+inline LevenState BasicFacade<N>::delta(const LevenState &cur_state, uint32_t letter)
+{
+    size_t i = cur_state.base;
+    size_t rl = get_window_size(i);
+    return make_successor(cur_state, CharVec(payload->get_bits(letter, i, rl), rl));
+}
+
+template<size_t N>
+inline LevenState BasicFacade<N>::delta_foreign(const LevenState &cur_state)
+{
+    return make_successor(cur_state, CharVec(0, get_window_size(cur_state.base)));
+}
+
+template<size_t N>
+inline size_t BasicFacade<N>::get_window_size(size_t i) const
+{
+    size_t rest = payload->w - i;
+    return (rest < WINDOW) ? rest : WINDOW;
+}
+
+template<size_t N>
+inline LevenState BasicFacade<N>::make_successor(const LevenState &cur_state, const CharVec &char_vec)
+{
+    LazyTable *lazy_table = payload->lazy_table;
+    LazyTable::TTransition transition = lazy_table->get_dense(cur_state.id, char_vec);
+    if (transition == LazyTable::UNKNOWN) {
+        transition = lazy_table->delta(cur_state.id, char_vec);
+    }
+
+    if (transition == LazyTable::DEAD) {
+        return LevenState(cur_state.base, LevenState::DEAD_ID);
+    }
+
+    return LevenState(cur_state.base + LazyTable::get_raise_level(transition), LazyTable::get_target(transition));
+}
+
+template<typename F>
+inline F make_facade(const std::string &word, size_t n)
+{
+    if constexpr (std::is_constructible_v<F, const std::string &, size_t>) {
+        return F(word, n);
+    } else {
+        return F(word);
+    }
 }
 
 }
@@ -1,51 +1,232 @@
 #include "mueddi.hh"
 #include "dawg.hh"
+#include "decoder.hh"
 #include "encoder.hh"
 #include "leven.hh"
+#include "wide.hh"
 
-#include <queue>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include <assert.h>
+#include <stdint.h>
 
 namespace mueddi
 {
 
+// The last letter of a candidate, linked to the letters before it,
+// which are shared with other candidates having the same prefix.
+class TrailNode
+{
+public:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    // or the next free node, for one on the free list
+    uint32_t parent;
+
+    uint32_t letter;
+
+    // queued items and child nodes ending with this node
+    uint32_t use_count;
+
+    TrailNode(uint32_t p, uint32_t x);
+};
+
+// The candidate of an item ends with node (NO_NODE for the empty
+// one).
 class QueueItem
 {
 public:
-    std::string candidate;
-    DawgStateRef dawg_state;
-    LevenStateRef leven_state;
+    uint32_t node;
+    TStateIndex dawg_state;
+    uint32_t ordinal; // of the first word with candidate as prefix
+    LevenState leven_state;
 
-    QueueItem(const std::string &v, const DawgStateRef &q, const LevenStateRef &m);
-    QueueItem(const QueueItem &other) = default;
-    QueueItem &operator=(const QueueItem &other) = default;
+    QueueItem(uint32_t c, TStateIndex q, uint32_t o, const LevenState &m);
 };
 
-using TQueue = std::queue<QueueItem>;
+// One level of the search (all candidates with the same number of
+// letters). The search keeps the level being expanded and the next
+// one, and their candidates as a tree of TrailNodes, freeing the
+// nodes no queued candidate ends with, so that memory is bounded by
+// the live candidates rather than by all visited ones and the search
+// needn't allocate a string per step. For the same reason, the bands
+// of WideFacade are compacted whenever a level is consumed.
+using TQueue = std::vector<QueueItem>;
+
+// A DAWG state on the path of the candidate, with a cursor over its
+// remaining children: edges [cursor, stop) of the state or, when
+// probing, window letters [cursor, stop) of the probe stack.
+class StackFrame
+{
+public:
+    TStateIndex dawg_state;
+    uint32_t ordinal; // of the first word with candidate as prefix
+    LevenState leven_state;
+    LevenState foreign;
+    size_t cursor;
+    size_t stop;
+    bool probing;
+
+    // of the candidate in bytes
+    size_t length;
+
+    // sizes of the probe stack and of the facade's states (for
+    // WideFacade) before the frame was entered
+    size_t probe_mark;
+    size_t state_mark;
+
+    StackFrame(TStateIndex q, uint32_t o, const LevenState &m, size_t l);
+};
 
 class IteratorPayload
 {
 public:
-    Facade facade;
-    TQueue queue;
+    // pinned by the caller
+    const FrozenDawg &frozen;
+    const size_t n;
     std::string current;
+    uint32_t current_ordinal;
     bool valid;
 
-    IteratorPayload(const std::string &seen, size_t n, const Dawg &dawg);
-    ~IteratorPayload() = default;
+    // scratch for advance
+    std::vector<uint32_t> window;
+
+    IteratorPayload(const FrozenDawg &frozen, size_t n);
+    virtual ~IteratorPayload() = default;
     IteratorPayload(const IteratorPayload &) = delete;
     IteratorPayload &operator=(const IteratorPayload &) = delete;
+
+    // finds the next match; valid stays false when there's none
+    virtual void advance() = 0;
+
+    // starts a search for seen, keeping the buffers
+    virtual void restart(const std::string &seen) = 0;
+};
+
+// F is Facade, one of its specializations BasicFacade<N> or, for n
+// above MAX_N, WideFacade; templated so that the inline methods of
+// specializations are called directly.
+template<typename F>
+class BreadthFirstPayload : public IteratorPayload
+{
+public:
+    static constexpr size_t INITIAL_LEVEL_SIZE = 256;
+
+    F facade;
+
+    // the level being expanded, from head on, and the next one
+    TQueue queue;
+    size_t head;
+    TQueue next;
+
+    std::vector<TrailNode> trail;
+    uint32_t free_node;
+
+    // size of the facade's states (for WideFacade) when the expansion
+    // of the current level started
+    size_t state_mark;
+
+    // scratch for set_current
+    std::vector<uint32_t> letters;
+
+    BreadthFirstPayload(const FrozenDawg &frozen, const std::string &seen, size_t n);
+
+    void advance() override;
+
+    void restart(const std::string &seen) override;
+
+private:
+    bool is_exhausted() const;
+
+    void push_child(const QueueItem &item, const FrozenEdge *it, const LevenState &mp);
+
+    // drops a use of node, freeing it (and its unused ancestors) when
+    // it was the last one
+    void release(uint32_t node);
+
+    void set_current(uint32_t node);
 };
 
-inline QueueItem::QueueItem(const std::string &v, const DawgStateRef &q, const LevenStateRef &m):
-    candidate(v),
+// Visits the DAWG depth-first, children in letter order, so matches
+// come in lexicographic (codepoint) order. Keeps just the path of the
+// candidate, whose letters are in current.
+template<typename F>
+class DepthFirstPayload : public IteratorPayload
+{
+public:
+    F facade;
+    std::vector<StackFrame> stack;
+
+    // window letters probed by the frames on the stack
+    std::vector<uint32_t> probes;
+
+    // of all candidates
+    const std::string prefix;
+
+    bool started;
+
+    DepthFirstPayload(const FrozenDawg &frozen, const std::string &seen, size_t n, const std::string &prefix = std::string());
+
+    void advance() override;
+
+    void restart(const std::string &seen) override;
+
+private:
+    // walks prefix and enters the state it reaches, if any
+    void start();
+
+    // checks whether the candidate (reaching q and m) matches and
+    // enters q, unless it has no children
+    void push_frame(TStateIndex q, uint32_t ordinal, const LevenState &m);
+
+    void pop_frame();
+};
+
+template<template<typename> class P, typename... Args>
+static std::shared_ptr<IteratorPayload> make_payload(const std::string &seen, size_t n, const FrozenDawg &frozen, const Args &...args);
+
+inline TrailNode::TrailNode(uint32_t p, uint32_t x):
+    parent(p),
+    letter(x),
+    use_count(1)
+{
+}
+
+inline QueueItem::QueueItem(uint32_t c, TStateIndex q, uint32_t o, const LevenState &m):
+    node(c),
     dawg_state(q),
+    ordinal(o),
     leven_state(m)
 {
 }
 
-InputIterator::InputIterator(const std::string &seen, size_t n, const Dawg &dawg):
-    payload(std::make_shared<IteratorPayload>(seen, n, dawg))
+inline StackFrame::StackFrame(TStateIndex q, uint32_t o, const LevenState &m, size_t l):
+    dawg_state(q),
+    ordinal(o),
+    leven_state(m),
+    foreign(m),
+    cursor(0),
+    stop(0),
+    probing(false),
+    length(l),
+    probe_mark(0),
+    state_mark(0)
+{
+}
+
+InputIterator::InputIterator(const std::string &seen, size_t n, const Dawg &dawg, SearchOrder order):
+    payload((order == SearchOrder::lexicographic)
+        ? make_payload<DepthFirstPayload>(seen, n, dawg.get_frozen())
+        : make_payload<BreadthFirstPayload>(seen, n, dawg.get_frozen()))
+{
+    advance();
+}
+
+InputIterator::InputIterator(const std::string &seen, size_t n, const Dawg &dawg, const std::string &prefix):
+    payload(make_payload<DepthFirstPayload>(seen, n, dawg.get_frozen(), prefix))
 {
     advance();
 }
@@ -71,8 +252,9 @@ InputIterator &InputIterator::operator=(const InputIterator &other)
 
 bool InputIterator::at_end() const
 {
+    // advance stops only at a match or at the end
     IteratorPayload *p = payload.get();
-    return !p || (!p->valid && p->queue.empty());
+    return !p || !p->valid;
 }
 
 bool InputIterator::operator==(const InputIterator &other) const
@@ -94,41 +276,362 @@ std::string InputIterator::operator*()
     return payload->current;
 }
 
+uint32_t InputIterator::get_ordinal() const
+{
+    assert(!at_end());
+    return payload->current_ordinal;
+}
+
+void InputIterator::restart(const std::string &seen)
+{
+    assert(payload);
+    payload->restart(seen);
+    advance();
+}
+
 void InputIterator::advance()
+{
+    assert(payload);
+    payload->advance();
+}
+
+IteratorPayload::IteratorPayload(const FrozenDawg &frozen, size_t n):
+    frozen(frozen),
+    n(n),
+    current_ordinal(0),
+    valid(false)
+{
+}
+
+template<typename F>
+BreadthFirstPayload<F>::BreadthFirstPayload(const FrozenDawg &frozen, const std::string &seen, size_t n):
+    IteratorPayload(frozen, n),
+    facade(make_facade<F>(seen, n)),
+    head(0),
+    free_node(TrailNode::NO_NODE),
+    state_mark(1)
+{
+    // levels near the root are small, and would otherwise grow the
+    // buffers in many small steps
+    queue.reserve(INITIAL_LEVEL_SIZE);
+    next.reserve(INITIAL_LEVEL_SIZE);
+    trail.reserve(INITIAL_LEVEL_SIZE);
+    queue.emplace_back(TrailNode::NO_NODE, frozen.get_root(), 0, F::initial_state());
+}
+
+template<typename F>
+void BreadthFirstPayload<F>::restart(const std::string &seen)
+{
+    facade = make_facade<F>(seen, n);
+    queue.clear();
+    head = 0;
+    next.clear();
+    trail.clear();
+    free_node = TrailNode::NO_NODE;
+    state_mark = 1;
+    queue.emplace_back(TrailNode::NO_NODE, frozen.get_root(), 0, F::initial_state());
+}
+
+template<typename F>
+void BreadthFirstPayload<F>::advance()
+{
+    valid = false;
+    while (!valid && !is_exhausted()) {
+        if (head == queue.size()) {
+            queue.swap(next);
+            next.clear();
+            head = 0;
+            if constexpr (std::is_same_v<F, WideFacade>) {
+                // only the states computed while expanding the
+                // consumed level are still used
+                uint32_t shift = facade.compact(state_mark);
+                for (QueueItem &queued: queue) {
+                    queued.leven_state.id -= shift;
+                }
+
+                state_mark = facade.get_state_count();
+            }
+        }
+
+        const QueueItem &item = queue[head++];
+        if (frozen.is_final(item.dawg_state) && facade.is_final(item.leven_state)) {
+            set_current(item.node);
+            current_ordinal = item.ordinal;
+            valid = true;
+        }
+
+        const FrozenEdge *b = frozen.begin(item.dawg_state);
+        const FrozenEdge *e = frozen.end(item.dawg_state);
+        if (b == e) {
+            release(item.node);
+            continue;
+        }
+
+        // all letters not in the window lead to the same state
+        LevenState foreign = facade.delta_foreign(item.leven_state);
+        if (foreign.is_dead()) {
+            facade.get_window_letters(item.leven_state, window);
+            if (window.size() < static_cast<size_t>(e - b)) {
+                // only children for window letters can survive;
+                // they're probed in letter order, like edges are
+                // iterated below
+                for (uint32_t x: window) {
+                    const FrozenEdge *it = frozen.find_edge(item.dawg_state, x);
+                    if (it) {
+                        LevenState mp = facade.delta(item.leven_state, x);
+                        if (!mp.is_dead()) {
+                            push_child(item, it, mp);
+                        }
+                    }
+                }
+
+                release(item.node);
+                continue;
+            }
+        }
+
+        for (const FrozenEdge *it = b; it != e; ++it) {
+            uint32_t x = it->letter;
+            LevenState mp = facade.has_letter(x) ? facade.delta(item.leven_state, x) : foreign;
+            if (!mp.is_dead()) {
+                push_child(item, it, mp);
+            }
+        }
+
+        release(item.node);
+    }
+}
+
+template<typename F>
+inline bool BreadthFirstPayload<F>::is_exhausted() const
+{
+    return (head == queue.size()) && next.empty();
+}
+
+template<typename F>
+inline void BreadthFirstPayload<F>::push_child(const QueueItem &item, const FrozenEdge *it, const LevenState &mp)
+{
+    if (item.node != TrailNode::NO_NODE) {
+        ++trail[item.node].use_count;
+    }
+
+    uint32_t node = free_node;
+    if (node == TrailNode::NO_NODE) {
+        if (trail.size() >= TrailNode::NO_NODE) {
+            throw std::runtime_error("search too wide");
+        }
+
+        node = trail.size();
+        trail.emplace_back(item.node, it->letter);
+    } else {
+        free_node = trail[node].parent;
+        trail[node] = TrailNode(item.node, it->letter);
+    }
+
+    uint32_t ordinal = item.ordinal + frozen.get_rank(item.dawg_state, it);
+    next.emplace_back(node, it->target, ordinal, mp);
+}
+
+template<typename F>
+void BreadthFirstPayload<F>::release(uint32_t node)
+{
+    while ((node != TrailNode::NO_NODE) && !--trail[node].use_count) {
+        uint32_t parent = trail[node].parent;
+        trail[node].parent = free_node;
+        free_node = node;
+        node = parent;
+    }
+}
+
+template<typename F>
+void BreadthFirstPayload<F>::set_current(uint32_t node)
 {
     char buf[5];
 
-    IteratorPayload *p = payload.get();
-    assert(p);
-
-    p->valid = false;
-    while (!p->valid && !p->queue.empty()) {
-        QueueItem item = p->queue.front();
-        p->queue.pop();
-        if (item.dawg_state->is_final() && p->facade.is_final(item.leven_state)) {
-            p->current = item.candidate;
-            p->valid = true;
+    letters.clear();
+    for (; node != TrailNode::NO_NODE; node = trail[node].parent) {
+        letters.push_back(trail[node].letter);
+    }
+
+    current.clear();
+    for (auto it = letters.rbegin(); it != letters.rend(); ++it) {
+        size_t l = utf8_encode(buf, *it);
+        assert(l);
+        current.append(buf, l);
+    }
+}
+
+template<typename F>
+DepthFirstPayload<F>::DepthFirstPayload(const FrozenDawg &frozen, const std::string &seen, size_t n, const std::string &prefix):
+    IteratorPayload(frozen, n),
+    facade(make_facade<F>(seen, n)),
+    prefix(prefix),
+    started(false)
+{
+}
+
+template<typename F>
+void DepthFirstPayload<F>::restart(const std::string &seen)
+{
+    facade = make_facade<F>(seen, n);
+    stack.clear();
+    probes.clear();
+    current.clear();
+    started = false;
+}
+
+template<typename F>
+void DepthFirstPayload<F>::advance()
+{
+    valid = false;
+    if (!started) {
+        started = true;
+        start();
+    }
+
+    char buf[5];
+    while (!valid && !stack.empty()) {
+        StackFrame &top = stack.back();
+        if (top.cursor == top.stop) {
+            pop_frame();
+            continue;
         }
 
-        for (TChildren::const_iterator it = item.dawg_state->begin(); it != item.dawg_state->end(); ++it) {
-            uint32_t x = it->first;
-            LevenStateRef mp = p->facade.delta(item.leven_state, x);
-            if (mp.get()) {
-                std::string v1(item.candidate);
-                size_t l = utf8_encode(buf, x);
-                assert(l);
-                v1.append(buf, l);
-                p->queue.emplace(v1, it->second, mp);
+        const FrozenEdge *it;
+        LevenState mp = top.foreign;
+        if (top.probing) {
+            uint32_t x = probes[top.cursor++];
+            it = frozen.find_edge(top.dawg_state, x);
+            if (!it) {
+                continue;
+            }
+
+            mp = facade.delta(top.leven_state, x);
+        } else {
+            it = frozen.begin(top.dawg_state) + top.cursor++;
+            if (facade.has_letter(it->letter)) {
+                mp = facade.delta(top.leven_state, it->letter);
             }
         }
+
+        if (mp.is_dead()) {
+            continue;
+        }
+
+        current.resize(top.length);
+        size_t l = utf8_encode(buf, it->letter);
+        assert(l);
+        current.append(buf, l);
+
+        // invalidates top
+        push_frame(it->target, top.ordinal + frozen.get_rank(top.dawg_state, it), mp);
     }
 }
 
-IteratorPayload::IteratorPayload(const std::string &seen, size_t n, const Dawg &dawg):
-    facade(seen, n),
-    valid(false)
+template<typename F>
+void DepthFirstPayload<F>::start()
 {
-    queue.emplace(std::string(), dawg.get_root(), Facade::initial_state());
+    TStateIndex q = frozen.get_root();
+    uint32_t ordinal = 0;
+    LevenState m = F::initial_state();
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+    for (char c: prefix) {
+        if (decode(&state, &codepoint, static_cast<unsigned char>(c)) != UTF8_ACCEPT) {
+            continue;
+        }
+
+        const FrozenEdge *it = frozen.find_edge(q, codepoint);
+        if (!it) {
+            return;
+        }
+
+        m = facade.delta(m, codepoint);
+        if (m.is_dead()) {
+            return;
+        }
+
+        ordinal += frozen.get_rank(q, it);
+        q = it->target;
+    }
+
+    if (state != UTF8_ACCEPT) {
+        throw std::runtime_error("cannot count invalid UTF-8");
+    }
+
+    current = prefix;
+    push_frame(q, ordinal, m);
+}
+
+template<typename F>
+void DepthFirstPayload<F>::push_frame(TStateIndex q, uint32_t ordinal, const LevenState &m)
+{
+    if (frozen.is_final(q) && facade.is_final(m)) {
+        current_ordinal = ordinal;
+        valid = true;
+    }
+
+    size_t fan_out = frozen.end(q) - frozen.begin(q);
+    if (!fan_out) {
+        return;
+    }
+
+    StackFrame frame(q, ordinal, m, current.size());
+    frame.probe_mark = probes.size();
+    if constexpr (std::is_same_v<F, WideFacade>) {
+        frame.state_mark = facade.get_state_count();
+    }
+
+    // all letters not in the window lead to the same state
+    frame.foreign = facade.delta_foreign(m);
+    frame.stop = fan_out;
+    if (frame.foreign.is_dead()) {
+        facade.get_window_letters(m, window);
+        if (window.size() < fan_out) {
+            // only children for window letters can survive; they're
+            // probed in letter order, like edges are iterated
+            probes.insert(probes.end(), window.begin(), window.end());
+            frame.cursor = frame.probe_mark;
+            frame.stop = probes.size();
+            frame.probing = true;
+        }
+    }
+
+    stack.push_back(frame);
+}
+
+template<typename F>
+void DepthFirstPayload<F>::pop_frame()
+{
+    const StackFrame &top = stack.back();
+    probes.resize(top.probe_mark);
+    if constexpr (std::is_same_v<F, WideFacade>) {
+        // only the finished subtree used states computed since
+        facade.truncate(top.state_mark);
+    }
+
+    stack.pop_back();
+}
+
+template<template<typename> class P, typename... Args>
+static std::shared_ptr<IteratorPayload> make_payload(const std::string &seen, size_t n, const FrozenDawg &frozen, const Args &...args)
+{
+    switch (n) {
+    case 1:
+        return std::make_shared<P<BasicFacade<1>>>(frozen, seen, n, args...);
+    case 2:
+        return std::make_shared<P<BasicFacade<2>>>(frozen, seen, n, args...);
+    case 3:
+        return std::make_shared<P<BasicFacade<3>>>(frozen, seen, n, args...);
+    case 4:
+        return std::make_shared<P<BasicFacade<4>>>(frozen, seen, n, args...);
+    default:
+        if (n > MAX_N) {
+            return std::make_shared<P<WideFacade>>(frozen, seen, n, args...);
+        }
+
+        return std::make_shared<P<Facade>>(frozen, seen, n, args...);
+    }
 }
 
 }
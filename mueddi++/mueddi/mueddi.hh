@@ -2,17 +2,35 @@
 #define mueddi_mueddi_hh
 
 #include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
 // for itself, this header could forward-declare, but it doubles as a
 // library-wide include for all externally used classes
 #include "dawg.hh"
+#include "sorter.hh"
 
 namespace mueddi
 {
 
 class IteratorPayload;
 
+// Order in which InputIterator finds matches. Breadth-first is the
+// default; it holds the candidates of two levels (words with the same
+// number of letters), which can be many for a big n. Lexicographic (by
+// codepoints) searches depth-first, holding just the candidate's path.
+enum class SearchOrder
+{
+    breadth_first,
+    lexicographic
+};
+
+// Finds the words of a Dawg within n corrections of seen. The
+// iterator doesn't share ownership of the Dawg's arrays, so that
+// threads searching one Dawg don't contend on its reference count:
+// the Dawg must outlive the iterator and stay unmodified while the
+// iterator is used.
 class InputIterator
 {
 public:
@@ -22,7 +40,10 @@ public:
     using pointer = std::string *;
     using reference = std::string &;
 
-    InputIterator(const std::string &seen, size_t n, const Dawg &dawg);
+    InputIterator(const std::string &seen, size_t n, const Dawg &dawg, SearchOrder order = SearchOrder::breadth_first);
+
+    // finds only words starting with prefix, in lexicographic order
+    InputIterator(const std::string &seen, size_t n, const Dawg &dawg, const std::string &prefix);
     InputIterator();
     ~InputIterator();
     InputIterator(const InputIterator &other);
@@ -33,6 +54,13 @@ public:
     std::string operator*();
     InputIterator &operator++();
 
+    // ordinal (in the Dawg) of the current word
+    uint32_t get_ordinal() const;
+
+    // searches for seen instead, with the Dawg, tolerance and order
+    // of this iterator (and its copies), reusing its buffers
+    void restart(const std::string &seen);
+
 private:
     bool at_end() const;
 
@@ -41,6 +69,100 @@ private:
     std::shared_ptr<IteratorPayload> payload;
 };
 
+class Query
+{
+public:
+    std::string word;
+    size_t n;
+
+    Query(const std::string &w, size_t n);
+};
+
+// Receives the results of a batch search. Its methods are called from
+// several threads at once, but those for one query from one thread:
+// add for each match, in search order, then done.
+class ResultSink
+{
+public:
+    virtual ~ResultSink() = default;
+
+    virtual void add(size_t index, const std::string &word, uint32_t ordinal) = 0;
+
+    virtual void done(size_t index);
+};
+
+// Keeps the matches of query i in results[i].
+class CollectingSink : public ResultSink
+{
+public:
+    std::vector<TWords> results;
+
+    explicit CollectingSink(size_t query_count);
+
+    void add(size_t index, const std::string &word, uint32_t ordinal) override;
+};
+
+class PoolPayload;
+
+// Worker threads for batch searches. A batch is split evenly between
+// the calling thread and the workers, which steal from each other
+// when they run out of queries; each keeps its iterators for reuse
+// within the batch. Batches submitted concurrently run one after
+// another, so a sink must not submit to the pool running it: that
+// throws (and fails the outer batch).
+class SearchPool
+{
+public:
+    // zero means one thread per core
+    explicit SearchPool(unsigned thread_count = 0);
+    ~SearchPool();
+    SearchPool(const SearchPool &) = delete;
+    SearchPool &operator=(const SearchPool &) = delete;
+
+    // including the calling thread
+    unsigned get_thread_count() const;
+
+    // the first exception thrown by a search or by sink cancels the
+    // remaining queries and is rethrown
+    void search_batch(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order = SearchOrder::breadth_first);
+
+    // Searches for one query on all threads: the subtrees a few
+    // levels below the root are searched separately, and their
+    // matches merged into lexicographic order. Reports them (as
+    // query 0) from the calling thread once all are found.
+    void search_parallel(const Dawg &dawg, const Query &query, ResultSink &sink);
+
+private:
+    // splits deeper than this don't pay off
+    static constexpr size_t MAX_SPLIT_DEPTH = 3;
+
+    std::unique_ptr<PoolPayload> payload;
+};
+
+// Searches for all queries in one depth-first traversal on the
+// calling thread: a DAWG state is visited once for all queries (with
+// the same n) reaching it, and only subtrees no query can reach are
+// skipped. Each query gets its matches in lexicographic order.
+void search_shared(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink);
+
+// Searches for the queries on the calling thread, width of them at a
+// time: each search runs as a coroutine, which prefetches the next
+// DAWG state it reads and yields to the others while it loads, so
+// that their cache misses overlap. Each query gets its matches in
+// lexicographic order.
+void search_interleaved(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, size_t width = 16);
+
+// these run on a pool shared by the process, which their sinks mustn't
+// use again
+void search_batch(const Dawg &dawg, std::span<const Query> queries, ResultSink &sink, SearchOrder order = SearchOrder::breadth_first);
+void search_parallel(const Dawg &dawg, const Query &query, ResultSink &sink);
+
+inline Query::Query(const std::string &w, size_t n):
+    word(w),
+    n(n)
+{
+}
+
 inline InputIterator &InputIterator::operator++()
 {
     advance();
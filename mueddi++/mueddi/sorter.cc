@@ -0,0 +1,252 @@
+#include "sorter.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace mueddi
+{
+
+// reads a run file: each word is stored as its 32-bit length followed
+// by its bytes
+class RunReader
+{
+public:
+    std::string word;
+
+    RunReader(const std::filesystem::path &path);
+    RunReader(const RunReader &) = delete;
+    RunReader &operator=(const RunReader &) = delete;
+
+    // returns false at the end of the run
+    bool next();
+
+private:
+    std::ifstream in;
+};
+
+static void write_word(std::ofstream &out, std::string_view word)
+{
+    uint32_t len = word.size();
+    out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+    out.write(word.data(), len);
+}
+
+RunReader::RunReader(const std::filesystem::path &path):
+    in(path, std::ios::binary)
+{
+    if (!in) {
+        throw std::runtime_error("cannot open " + path.native());
+    }
+}
+
+bool RunReader::next()
+{
+    uint32_t len;
+    if (!in.read(reinterpret_cast<char *>(&len), sizeof(len))) {
+        if (in.bad() || in.gcount()) {
+            throw std::runtime_error("cannot read run");
+        }
+
+        return false;
+    }
+
+    word.resize(len);
+    if (!in.read(word.data(), len)) {
+        throw std::runtime_error("cannot read run");
+    }
+
+    return true;
+}
+
+ExternalSorter::ExternalSorter(size_t memory_limit, const std::filesystem::path &temp_dir):
+    memory_limit(memory_limit),
+    temp_dir(temp_dir),
+    chunk_size(0)
+{
+}
+
+ExternalSorter::~ExternalSorter()
+{
+    remove_runs();
+}
+
+void ExternalSorter::add(std::string_view word)
+{
+    if (word.size() > UINT32_MAX) {
+        throw std::runtime_error("word too long");
+    }
+
+    chunk.emplace_back(word);
+    chunk_size += sizeof(std::string) + word.size();
+    if (chunk_size > memory_limit) {
+        spill();
+    }
+}
+
+void ExternalSorter::add_lines(std::istream &in)
+{
+    std::string line;
+    while (std::getline(in, line)) {
+        add(line);
+    }
+
+    if (in.bad()) {
+        throw std::runtime_error("cannot read words");
+    }
+}
+
+void ExternalSorter::merge_into(StreamingBuilder &builder)
+{
+    // std::string compares bytes as unsigned, i.e. UTF-8 by codepoints
+    std::sort(chunk.begin(), chunk.end());
+    if (runs.empty()) {
+        for (const std::string &word: chunk) {
+            builder.add(word);
+        }
+
+        TWords().swap(chunk);
+        chunk_size = 0;
+        return;
+    }
+
+    spill();
+    while (runs.size() > MAX_FAN_IN) {
+        // listed before it's written, so that it's removed even if
+        // the merge fails
+        std::filesystem::path out_path = make_run_path();
+        runs.push_back(out_path);
+        merge_runs(runs.begin(), runs.begin() + MAX_FAN_IN, nullptr, &out_path);
+        for (size_t i = 0; i < MAX_FAN_IN; ++i) {
+            std::filesystem::remove(runs[i]);
+        }
+
+        runs.erase(runs.begin(), runs.begin() + MAX_FAN_IN);
+    }
+
+    merge_runs(runs.begin(), runs.end(), &builder, nullptr);
+    remove_runs();
+}
+
+Dawg ExternalSorter::finish()
+{
+    StreamingBuilder builder;
+    merge_into(builder);
+    return builder.finish();
+}
+
+void ExternalSorter::spill()
+{
+    std::sort(chunk.begin(), chunk.end());
+    auto last = std::unique(chunk.begin(), chunk.end());
+
+    std::filesystem::path path = make_run_path();
+    runs.push_back(path);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for (auto it = chunk.begin(); it != last; ++it) {
+        write_word(out, *it);
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error("cannot write " + path.native());
+    }
+
+    TWords().swap(chunk);
+    chunk_size = 0;
+}
+
+std::filesystem::path ExternalSorter::make_run_path()
+{
+    std::string name = (temp_dir / "mueddi-run-XXXXXX").native();
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+        throw std::runtime_error("cannot create a run file in " + temp_dir.native());
+    }
+
+    close(fd);
+    return std::filesystem::path(name);
+}
+
+// k-way merge of sorted runs, skipping duplicates, into either a
+// builder or a new run
+void ExternalSorter::merge_runs(TRuns::const_iterator b, TRuns::const_iterator e, StreamingBuilder *builder, const std::filesystem::path *out_path)
+{
+    using TReaders = std::vector<std::unique_ptr<RunReader>>;
+
+    TReaders readers;
+    for (auto it = b; it != e; ++it) {
+        readers.push_back(std::make_unique<RunReader>(*it));
+    }
+
+    auto greater = [&readers](size_t x, size_t y) {
+        return readers[x]->word > readers[y]->word;
+    };
+
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t i = 0; i < readers.size(); ++i) {
+        if (readers[i]->next()) {
+            heap.push(i);
+        }
+    }
+
+    std::ofstream out;
+    if (out_path) {
+        out.open(*out_path, std::ios::binary | std::ios::trunc);
+    }
+
+    std::string last;
+    bool first = true;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+
+        RunReader &reader = *(readers[i]);
+        if (first || (reader.word != last)) {
+            first = false;
+            if (builder) {
+                builder->add(reader.word);
+            } else {
+                write_word(out, reader.word);
+            }
+
+            last = reader.word;
+        }
+
+        if (reader.next()) {
+            heap.push(i);
+        }
+    }
+
+    if (out_path) {
+        out.close();
+        if (!out) {
+            throw std::runtime_error("cannot write " + out_path->native());
+        }
+    }
+}
+
+void ExternalSorter::remove_runs()
+{
+    for (const std::filesystem::path &path: runs) {
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+    }
+
+    runs.clear();
+}
+
+Dawg make_dawg_external(std::istream &in, size_t memory_limit)
+{
+    ExternalSorter sorter(memory_limit);
+    sorter.add_lines(in);
+    return sorter.finish();
+}
+
+}
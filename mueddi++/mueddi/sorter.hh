@@ -0,0 +1,65 @@
+#ifndef mueddi_sorter_hh
+#define mueddi_sorter_hh
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stddef.h>
+
+#include "dawg.hh"
+
+namespace mueddi
+{
+
+// Sorts and deduplicates words which needn't fit in memory: they're
+// collected in chunks of limited size, each chunk is sorted and
+// spilled into a temporary run file, and the runs are finally merged
+// into a StreamingBuilder. Input fitting into one chunk never touches
+// the disk.
+class ExternalSorter
+{
+public:
+    ExternalSorter(size_t memory_limit = 256 << 20, const std::filesystem::path &temp_dir = std::filesystem::temp_directory_path());
+    ~ExternalSorter(); // removes the run files
+    ExternalSorter(const ExternalSorter &) = delete;
+    ExternalSorter &operator=(const ExternalSorter &) = delete;
+
+    void add(std::string_view word);
+
+    // adds each line as a word
+    void add_lines(std::istream &in);
+
+    // adds all words to builder, in order and each once; the sorter
+    // is empty afterwards
+    void merge_into(StreamingBuilder &builder);
+
+    Dawg finish();
+
+private:
+    using TRuns = std::vector<std::filesystem::path>;
+
+    // more runs than this are merged in several passes
+    static constexpr size_t MAX_FAN_IN = 64;
+
+    void spill();
+
+    std::filesystem::path make_run_path();
+
+    void merge_runs(TRuns::const_iterator b, TRuns::const_iterator e, StreamingBuilder *builder, const std::filesystem::path *out_path);
+
+    void remove_runs();
+
+    const size_t memory_limit;
+    const std::filesystem::path temp_dir;
+    TWords chunk;
+    size_t chunk_size;
+    TRuns runs;
+};
+
+Dawg make_dawg_external(std::istream &in, size_t memory_limit = 256 << 20);
+
+}
+
+#endif
@@ -21,6 +21,23 @@ size_t hash_list(const C &container)
     return (b << 16) | a;
 }
 
+inline size_t hash_combine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+// spreads a hash over all bits, so that its low bits can index a
+// power-of-two table
+inline size_t hash_finish(size_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
 }
 
 #endif
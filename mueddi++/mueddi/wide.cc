@@ -0,0 +1,149 @@
+#include "wide.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <assert.h>
+
+namespace mueddi
+{
+
+WideFacade::Payload::Payload(const std::string &word, size_t n):
+    DecodedWord(word),
+    n(n)
+{
+    if (n > MAX_WIDE_N) {
+        throw std::runtime_error("number of corrections too big for this package");
+    }
+
+    // the initial band: distance j to the first j letters
+    size_t band_size = get_band_size();
+    cells.resize(band_size);
+    for (size_t k = 0; k < band_size; ++k) {
+        size_t j = k - n;
+        cells[k] = ((k >= n) && (j <= w)) ? j : n + 1;
+    }
+}
+
+WideFacade::WideFacade(const std::string &word, size_t n):
+    payload(std::make_shared<Payload>(word, n))
+{
+}
+
+bool WideFacade::is_final(const LevenState &state) const
+{
+    assert(!state.is_dead());
+
+    const Payload *p = payload.get();
+    size_t k = p->w + p->n - state.base;
+    if ((state.base > p->w + p->n) || (k >= p->get_band_size())) {
+        return false;
+    }
+
+    return p->cells[state.id * p->get_band_size() + k] <= p->n;
+}
+
+LevenState WideFacade::delta(const LevenState &cur_state, uint32_t letter)
+{
+    return make_successor(cur_state, letter);
+}
+
+LevenState WideFacade::delta_foreign(const LevenState &cur_state)
+{
+    return make_successor(cur_state, UINT32_MAX);
+}
+
+bool WideFacade::has_letter(uint32_t letter) const
+{
+    return payload->has_letter(letter);
+}
+
+void WideFacade::get_window_letters(const LevenState &state, std::vector<uint32_t> &window) const
+{
+    assert(!state.is_dead());
+
+    // letters compared by the next step
+    const Payload *p = payload.get();
+    size_t first = (state.base > p->n) ? state.base - p->n : 0;
+    size_t last = std::min(state.base + p->n + 1, p->w);
+    p->get_distinct_letters(first, last, window);
+}
+
+LevenState WideFacade::initial_state()
+{
+    return LevenState(0, 0);
+}
+
+size_t WideFacade::get_state_count() const
+{
+    return payload->cells.size() / payload->get_band_size();
+}
+
+void WideFacade::truncate(size_t count)
+{
+    assert(count);
+    assert(count <= get_state_count());
+    payload->cells.resize(count * payload->get_band_size());
+}
+
+uint32_t WideFacade::compact(size_t first)
+{
+    assert(first);
+    assert(first <= get_state_count());
+    Payload *p = payload.get();
+    size_t band_size = p->get_band_size();
+    p->cells.erase(p->cells.begin() + band_size, p->cells.begin() + first * band_size);
+    return first - 1;
+}
+
+LevenState WideFacade::make_successor(const LevenState &cur_state, uint32_t letter)
+{
+    assert(!cur_state.is_dead());
+
+    Payload *p = payload.get();
+    size_t n = p->n;
+    size_t band_size = p->get_band_size();
+    size_t count = p->cells.size() / band_size;
+    if (count >= LevenState::DEAD_ID) {
+        throw std::runtime_error("too many automaton states");
+    }
+
+    // the successor is appended, and dropped again if it's dead
+    p->cells.resize(p->cells.size() + band_size);
+    const uint8_t *band = p->cells.data() + cur_state.id * band_size;
+    uint8_t *next = p->cells.data() + count * band_size;
+
+    // cell k of the successor and cell k + 1 of band are for the
+    // same j, the number of word letters
+    unsigned inf = n + 1;
+    bool alive = false;
+    size_t base = cur_state.base + 1;
+    for (size_t k = 0; k < band_size; ++k) {
+        size_t j = base + k - n;
+        unsigned d = inf;
+        if ((base + k >= n) && (j <= p->w)) {
+            if (k + 1 < band_size) {
+                d = std::min(d, band[k + 1] + 1u);
+            }
+
+            if (j) {
+                d = std::min(d, band[k] + unsigned(p->letters[j - 1] != letter));
+            }
+
+            if (k) {
+                d = std::min(d, next[k - 1] + 1u);
+            }
+        }
+
+        next[k] = d;
+        alive = alive || (d < inf);
+    }
+
+    if (!alive) {
+        p->cells.resize(count * band_size);
+        return LevenState(base, LevenState::DEAD_ID);
+    }
+
+    return LevenState(base, count);
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef mueddi_wide_hh
+#define mueddi_wide_hh
+
+#include "leven.hh"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mueddi
+{
+
+// Levenshtein automaton for tolerances above MAX_N, whose universal
+// automaton has too many states to tabulate and too wide
+// characteristic vectors. A state is the band of the dynamic
+// programming matrix around the diagonal, for base letters read:
+// cell k holds the distance (capped at n + 1) to the first base - n
+// + k letters of the word. Bands live in an arena of the facade,
+// which grows with the states computed by one search.
+class WideFacade
+{
+public:
+    static constexpr size_t MAX_WIDE_N = UINT8_MAX - 1;
+
+    WideFacade(const std::string &word, size_t n);
+    WideFacade(const WideFacade &other) = default;
+    WideFacade &operator=(const WideFacade &other) = default;
+
+    bool is_final(const LevenState &state) const;
+
+    LevenState delta(const LevenState &cur_state, uint32_t letter);
+
+    // the common successor for all letters which don't occur in the
+    // window of cur_state
+    LevenState delta_foreign(const LevenState &cur_state);
+
+    // whether letter occurs anywhere in the word
+    bool has_letter(uint32_t letter) const;
+
+    // sorted distinct letters of the window of state
+    void get_window_letters(const LevenState &state, std::vector<uint32_t> &window) const;
+
+    static LevenState initial_state();
+
+    size_t get_state_count() const;
+
+    // drops the states from count up, once a depth-first search has
+    // left the subtree which used them
+    void truncate(size_t count);
+
+    // drops the states [1, first), once a breadth-first search has
+    // consumed the levels which used them, and returns by how much
+    // the ids of the remaining ones (but the initial) decreased
+    uint32_t compact(size_t first);
+
+private:
+    class Payload : public DecodedWord
+    {
+    public:
+        size_t n;
+
+        // band of state id starts at id * (2 * n + 1)
+        std::vector<uint8_t> cells;
+
+        Payload(const std::string &word, size_t n);
+        ~Payload() = default;
+        Payload(const Payload &) = delete;
+        Payload &operator=(const Payload &) = delete;
+
+        size_t get_band_size() const;
+    };
+
+    std::shared_ptr<Payload> payload;
+
+    // letter is UINT32_MAX for a foreign one
+    LevenState make_successor(const LevenState &cur_state, uint32_t letter);
+};
+
+inline size_t WideFacade::Payload::get_band_size() const
+{
+    return 2 * n + 1;
+}
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "acutest.h"
+#include "mueddi.hh"
+
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+using namespace mueddi;
+
+// counts the allocations of the whole binary, which is why this test
+// has one of its own
+static std::atomic<size_t> allocation_count(0);
+
+void *operator new(size_t size)
+{
+    ++allocation_count;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void test_allocations()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 20000; ++i) {
+        words.push_back(std::to_string(i));
+    }
+
+    Dawg dawg = make_dawg(words);
+    size_t count = 0;
+    for (InputIterator it(std::string("12345"), 2, dawg); it != InputIterator(); ++it) {
+        ++count;
+    }
+
+    // results are short enough not to allocate, so allocations
+    // don't depend on the number of explored edges
+    size_t before = allocation_count;
+    size_t again = 0;
+    for (InputIterator it(std::string("12345"), 2, dawg); it != InputIterator(); ++it) {
+        ++again;
+    }
+
+    size_t allocations = allocation_count - before;
+    TEST_CHECK(count > 100);
+    TEST_CHECK(again == count);
+    TEST_CHECK(allocations < 40);
+    TEST_MSG("%zu allocations", allocations);
+}
+
+TEST_LIST = {
+   { "allocations", test_allocations },
+   { nullptr, nullptr }
+};
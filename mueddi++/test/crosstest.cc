@@ -223,7 +223,6 @@ int main(int argc, char *argv[])
 
         std::set<std::string> dictionary = make_test_dict(input_path);
         std::set<std::string> dd = dictionary;
-        // actually only needed in single mode
         Dawg dawg = make_dawg(dd);
 
         if (!std::filesystem::exists(result_path)) {
@@ -243,14 +242,15 @@ int main(int argc, char *argv[])
 
                 if (!single_mode) {
                     dd.erase(tword);
+                    dawg.erase(tword);
 
                     if (first) {
                         first = false;
                     } else {
                         dd.insert(last_word);
+                        dawg.insert(last_word);
                     }
 
-                    dawg = make_dawg(dd);
                     last_word = tword;
                 }
 
@@ -303,14 +303,15 @@ int main(int argc, char *argv[])
 
                 if (!single_mode) {
                     dd.erase(tword);
+                    dawg.erase(tword);
 
                     if (first) {
                         first = false;
                     } else {
                         dd.insert(last_word);
+                        dawg.insert(last_word);
                     }
 
-                    dawg = make_dawg(dd);
                     last_word = tword;
                 }
 
@@ -1,12 +1,54 @@
 #include "acutest.h"
+#include "encoder.hh"
+#include "leven.hh"
+#include "levenshtein.hh"
 #include "mueddi.hh"
+#include "wide.hh"
 
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 #include <set>
 #include <string>
+#include <stdlib.h>
+#include <unistd.h>
 
 using namespace mueddi;
 
+// A file of a unique name in the temporary directory, removed (with
+// whatever the test wrote to it) however the test ends.
+class TempFile
+{
+public:
+    std::filesystem::path path;
+
+    TempFile();
+    ~TempFile();
+    TempFile(const TempFile &) = delete;
+    TempFile &operator=(const TempFile &) = delete;
+};
+
+TempFile::TempFile()
+{
+    std::string name = (std::filesystem::temp_directory_path() / "mueddi-test-XXXXXX").native();
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+        throw std::runtime_error("cannot create a temporary file");
+    }
+
+    close(fd);
+    path = name;
+}
+
+TempFile::~TempFile()
+{
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+}
+
 void test_initial_final()
 {
     const char *data[] = { "", "a" };
@@ -138,12 +180,909 @@ void test_binary()
     TEST_CHECK(res == std::set<std::string>(data, data + 2));
 }
 
+void test_frozen()
+{
+    const char *data[] = { "cat", "cats", "fat", "fats" };
+
+    std::vector<std::string> v;
+    for (size_t i = 0; i < 4; ++i) {
+        v.push_back(std::string(data[i]));
+    }
+
+    Dawg dawg = make_dawg(v);
+    const FrozenDawg &frozen = dawg.get_frozen();
+    TEST_CHECK(frozen.get_state_count() == 5);
+    TEST_CHECK(frozen.get_edge_count() == 5);
+
+    TStateIndex root = frozen.get_root();
+    TEST_CHECK(!frozen.is_final(root));
+    TEST_CHECK(frozen.end(root) - frozen.begin(root) == 2);
+    TEST_CHECK(frozen.begin(root)->letter == 'c');
+    TStateIndex c = frozen.get_child(root, 'c');
+    TEST_CHECK(c != FrozenDawg::NO_STATE);
+    TEST_CHECK(c == frozen.get_child(root, 'f'));
+    TEST_CHECK(frozen.get_child(root, 'a') == FrozenDawg::NO_STATE);
+
+    for (size_t i = 0; i < 4; ++i) {
+        TEST_CHECK(dawg.accepts(v[i]));
+    }
+
+    TEST_CHECK(!dawg.accepts("ca"));
+    TEST_CHECK(!dawg.accepts("catss"));
+}
+
+void test_save_load()
+{
+    const char *data[] = { "meter", "otter", "potter", "žluť" };
+
+    std::vector<std::string> v;
+    for (size_t i = 0; i < 4; ++i) {
+        v.push_back(std::string(data[i]));
+    }
+
+    TempFile temp;
+    const std::filesystem::path &path = temp.path;
+    make_dawg(v).save(path.native());
+
+    {
+        Dawg dawg = Dawg::open_mmap(path.native());
+        for (size_t i = 0; i < 4; ++i) {
+            TEST_CHECK(dawg.accepts(v[i]));
+        }
+
+        TEST_CHECK(!dawg.accepts("mutter"));
+
+        InputIterator it(std::string("mutter"), 2, dawg);
+        std::set<std::string> res(it, InputIterator());
+        TEST_CHECK(res == std::set<std::string>(data, data + 3));
+
+        // replacing the file leaves the mapping intact
+        make_dawg(std::vector<std::string>(v.begin(), v.begin() + 2)).save(path.native());
+        TEST_CHECK(dawg.accepts("žluť"));
+        TEST_CHECK(!Dawg::open_mmap(path.native()).accepts("žluť"));
+    }
+
+    // a modified Dawg keeps children before parents
+    Dawg edited = make_dawg(v);
+    TEST_CHECK(edited.insert("metro"));
+    TEST_CHECK(edited.erase("otter"));
+    edited.save(path.native());
+    TEST_CHECK(Dawg::open_mmap(path.native()).word_at(0) == "meter");
+
+    // a target out of range, a cycle and a wrong rank, all in the last
+    // edge (of the root)
+    Dawg original = make_dawg(v);
+    uint32_t root = original.get_frozen().get_root();
+    std::pair<int, uint32_t> patches[] = { { -8, UINT32_MAX - 1 }, { -8, root }, { -4, 12345 } };
+    for (const auto &[offset, value]: patches) {
+        original.save(path.native());
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(offset, std::ios::end);
+            file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        TEST_EXCEPTION(Dawg::open_mmap(path.native()), std::runtime_error);
+    }
+}
+
+size_t count_reachable(const FrozenDawg &frozen)
+{
+    std::set<TStateIndex> seen;
+    std::vector<TStateIndex> stack;
+    stack.push_back(frozen.get_root());
+    while (!stack.empty()) {
+        TStateIndex state = stack.back();
+        stack.pop_back();
+        if (seen.insert(state).second) {
+            for (const FrozenEdge *it = frozen.begin(state); it != frozen.end(state); ++it) {
+                stack.push_back(it->target);
+            }
+        }
+    }
+
+    return seen.size();
+}
+
+void test_insert_erase()
+{
+    const char *data[] = { "cat", "cats", "fat", "fats", "tap", "taps", "" };
+
+    std::vector<std::string> v;
+    for (size_t i = 0; i < 7; ++i) {
+        v.push_back(std::string(data[i]));
+    }
+
+    Dawg dawg = make_dawg(std::vector<std::string>(v.begin(), v.begin() + 2));
+    Dawg copy = dawg;
+    for (size_t i = 2; i < 7; ++i) {
+        TEST_CHECK(dawg.insert(v[i]));
+    }
+
+    TEST_CHECK(!dawg.insert("fat"));
+    for (size_t i = 0; i < 7; ++i) {
+        TEST_CHECK(dawg.accepts(v[i]));
+    }
+
+    TEST_CHECK(!copy.accepts("fat"));
+    TEST_CHECK(count_reachable(dawg.get_frozen()) == make_dawg(v).get_frozen().get_state_count());
+
+    TEST_CHECK(dawg.erase("cats"));
+    TEST_CHECK(dawg.erase(""));
+    TEST_CHECK(!dawg.erase("cats"));
+    TEST_CHECK(!dawg.erase("ca"));
+    TEST_CHECK(!dawg.accepts("cats"));
+    TEST_CHECK(!dawg.accepts(""));
+    TEST_CHECK(dawg.accepts("cat"));
+
+    const char *rest[] = { "cat", "fat", "fats", "tap", "taps" };
+    TEST_CHECK(count_reachable(dawg.get_frozen()) == make_dawg(rest).get_frozen().get_state_count());
+
+    InputIterator it(std::string("cap"), 1, dawg);
+    std::set<std::string> res(it, InputIterator());
+    TEST_CHECK(res == std::set<std::string>({ "cat", "tap" }));
+
+    for (size_t i = 0; i < 5; ++i) {
+        TEST_CHECK(dawg.erase(rest[i]));
+    }
+
+    TEST_CHECK(count_reachable(dawg.get_frozen()) == 1);
+    TEST_CHECK(dawg.insert("dog"));
+    TEST_CHECK(dawg.accepts("dog"));
+
+    // assignment leaves the register to the copy viewing it
+    Dawg modified = make_dawg(rest);
+    TEST_CHECK(modified.insert("bat"));
+    Dawg view = modified;
+    {
+        const char *other[] = { "x", "xy", "xyz" };
+        Dawg assigned = make_dawg(other);
+        modified = assigned;
+    }
+
+    TEST_CHECK(modified.insert("xyzzy"));
+    TEST_CHECK(modified.accepts("xy"));
+    TEST_CHECK(modified.accepts("xyzzy"));
+    TEST_CHECK(!modified.accepts("bat"));
+    TEST_CHECK(view.accepts("bat"));
+    TEST_CHECK(view.accepts("taps"));
+    TEST_CHECK(!view.accepts("xy"));
+}
+
+void test_parallel()
+{
+    const char *letters[] = { "a", "b", "c", "d", "e", "č", "ř", "ž" };
+
+    TWords words;
+    words.push_back(std::string());
+    for (size_t i = 0; i < 100000; ++i) {
+        std::string w;
+        for (size_t j = i * 7919 % 100003; j; j /= 8) {
+            w += letters[j % 8];
+        }
+
+        words.push_back(w);
+    }
+
+    TWords copy = words;
+    Dawg sequential = make_dawg_impl(copy, 1);
+    TWords sorted = copy;
+    copy = words;
+    Dawg parallel = make_dawg_impl(copy, 4);
+    TEST_CHECK(copy == sorted);
+
+    const FrozenDawg &seq_frozen = sequential.get_frozen();
+    const FrozenDawg &par_frozen = parallel.get_frozen();
+    TEST_CHECK(seq_frozen.get_state_count() == par_frozen.get_state_count());
+    TEST_CHECK(seq_frozen.get_edge_count() == par_frozen.get_edge_count());
+    TEST_CHECK(count_reachable(par_frozen) == par_frozen.get_state_count());
+    for (size_t i = 0; i < words.size(); i += 97) {
+        TEST_CHECK(parallel.accepts(words[i]));
+    }
+
+    TEST_CHECK(!parallel.accepts("ccccccccc"));
+
+    // leading letters of 3 and 4 bytes, which share their first two
+    // with many others
+    TWords wide;
+    std::set<uint32_t> leads;
+    char buf[5];
+    for (size_t i = 0; i < 100000; ++i) {
+        uint32_t lead = (i % 3) ? 0x4e00 + i * 7919 % 64 : 0x1f600 + i * 7919 % 48;
+        leads.insert(lead);
+        std::string w(buf, utf8_encode(buf, lead));
+        w += std::to_string(i * 7919 % 100003);
+        wide.push_back(w);
+    }
+
+    copy = wide;
+    sequential = make_dawg_impl(copy, 1);
+    copy = wide;
+    parallel = make_dawg_impl(copy, 4);
+    const FrozenDawg &seq_wide = sequential.get_frozen();
+    const FrozenDawg &par_wide = parallel.get_frozen();
+    TEST_CHECK(par_wide.end(par_wide.get_root()) - par_wide.begin(par_wide.get_root()) == ptrdiff_t(leads.size()));
+    TEST_CHECK(seq_wide.get_state_count() == par_wide.get_state_count());
+    TEST_CHECK(seq_wide.get_edge_count() == par_wide.get_edge_count());
+    for (const std::string &w: wide) {
+        if (!parallel.contains(w)) {
+            TEST_CHECK(false);
+            TEST_MSG("missing %s", w.c_str());
+            break;
+        }
+    }
+}
+
+void test_streaming()
+{
+    StreamingBuilder builder;
+    builder.add("");
+    builder.add("abc");
+    builder.add(std::string_view("abd"));
+    builder.add("abd");
+
+    std::istringstream lines("b\nbc\nč\n");
+    builder.add_lines(lines);
+
+    bool thrown = false;
+    try {
+        builder.add("a");
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+
+    TEST_CHECK(thrown);
+
+    Dawg dawg = builder.finish();
+    const char *data[] = { "", "abc", "abd", "b", "bc", "č" };
+    for (size_t i = 0; i < 6; ++i) {
+        TEST_CHECK(dawg.accepts(data[i]));
+    }
+
+    TEST_CHECK(!dawg.accepts("a"));
+    TEST_CHECK(dawg.get_frozen().get_state_count() == make_dawg(data).get_frozen().get_state_count());
+
+    TempFile temp;
+    const std::filesystem::path &path = temp.path;
+    {
+        std::ofstream out(path);
+        for (size_t i = 1; i < 6; ++i) {
+            out << data[i] << '\n';
+        }
+    }
+
+    Dawg from_file = make_dawg_from_sorted_file(path.native());
+    TEST_CHECK(from_file.accepts("bc"));
+    TEST_CHECK(!from_file.accepts(""));
+}
+
+void test_external()
+{
+    std::vector<std::string> words;
+    std::string text;
+    for (unsigned i = 0; i < 3000; ++i) {
+        unsigned n = (i * 7919) % 1000;
+        std::string word = std::to_string(n) + "ž";
+        words.push_back(word);
+        text += word + '\n';
+    }
+
+    // tiny limit forces many runs and a multi-pass merge
+    std::istringstream in(text);
+    Dawg external = make_dawg_external(in, 256);
+    Dawg internal = make_dawg(words);
+    TEST_CHECK(external.get_frozen().get_state_count() == internal.get_frozen().get_state_count());
+    TEST_CHECK(external.get_frozen().get_edge_count() == internal.get_frozen().get_edge_count());
+    TEST_CHECK(external.accepts("999ž"));
+    TEST_CHECK(!external.accepts("1000ž"));
+
+    ExternalSorter sorter;
+    sorter.add("b");
+    sorter.add("a");
+    sorter.add("b");
+    Dawg small = sorter.finish();
+    TEST_CHECK(small.accepts("a"));
+    TEST_CHECK(small.accepts("b"));
+    TEST_CHECK(!small.accepts(""));
+}
+
+void test_contains()
+{
+    const char *data[] = { "", "abc", "abd", "b", "čř", "čš" };
+    const Dawg dawg = make_dawg(data);
+    TEST_CHECK(dawg.contains(""));
+    TEST_CHECK(dawg.contains("čš"));
+    TEST_CHECK(!dawg.contains("č"));
+    TEST_CHECK(!dawg.contains("ab"));
+    TEST_CHECK(!dawg.contains("\xc4"));
+    TEST_CHECK(!dawg.contains("a\xff" "bc"));
+    TEST_CHECK(!dawg.contains(std::string_view("abc\0", 4)));
+
+    std::vector<std::string_view> words = { "b", "čš", "a\xff", "abd", "č", "abc", "a\xffx", "ab", "", "\xc4", "čř", "bb", "abc" };
+    std::vector<bool> found;
+    dawg.contains_many(words, found);
+    TEST_CHECK(found.size() == words.size());
+    for (size_t i = 0; i < words.size(); ++i) {
+        TEST_CHECK(found[i] == dawg.contains(words[i]));
+        TEST_MSG("word %zu", i);
+    }
+
+    TEST_CHECK(found[0] && found[1] && !found[2] && found[3] && !found[4]);
+}
+
+void test_ordinal()
+{
+    // sorted by codepoints
+    const char *data[] = { "", "ab", "abc", "b", "ba", "bč", "z", "č" };
+    Dawg dawg = make_dawg(data);
+    TEST_CHECK(dawg.get_word_count() == 8);
+    for (uint32_t i = 0; i < 8; ++i) {
+        TEST_CHECK(dawg.ordinal(data[i]) == i);
+        TEST_CHECK(dawg.word_at(i) == data[i]);
+    }
+
+    TEST_CHECK(dawg.ordinal("a") == FrozenDawg::NO_ORDINAL);
+    TEST_CHECK(dawg.ordinal("bc") == FrozenDawg::NO_ORDINAL);
+    TEST_CHECK(dawg.ordinal("\xc4") == FrozenDawg::NO_ORDINAL);
+
+    bool thrown = false;
+    try {
+        dawg.word_at(8);
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+
+    TEST_CHECK(thrown);
+
+    TEST_CHECK(dawg.insert("bb"));
+    TEST_CHECK(dawg.erase("ab"));
+    TEST_CHECK(dawg.get_word_count() == 8);
+    TEST_CHECK(dawg.ordinal("bb") == 4);
+    TEST_CHECK(dawg.word_at(1) == "abc");
+
+    InputIterator end;
+    for (InputIterator it(std::string("b"), 1, dawg); it != end; ++it) {
+        TEST_CHECK(dawg.ordinal(*it) == it.get_ordinal());
+        TEST_MSG("word %s", (*it).c_str());
+    }
+}
+
+void test_concurrent()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 2000; ++i) {
+        words.push_back(std::to_string(i * 7919 % 100000) + "ř");
+    }
+
+    const Dawg dawg = make_dawg(words);
+    const char *queries[] = { "1234ř", "99ř", "7919", "5000řř", "řř", "31337" };
+    const size_t thread_count = 4;
+    using TResults = std::vector<std::set<std::string>>;
+
+    // the tables for these n are cold, so threads race to fill them
+    std::vector<TResults> results(thread_count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&dawg, &queries, &results, t]() {
+                for (size_t n = 4; n <= 5; ++n) {
+                    for (const char *q: queries) {
+                        InputIterator it(std::string(q), n, dawg);
+                        results[t].emplace_back(it, InputIterator());
+                    }
+                }
+            });
+    }
+
+    for (std::thread &thread: threads) {
+        thread.join();
+    }
+
+    TResults expected;
+    for (size_t n = 4; n <= 5; ++n) {
+        for (const char *q: queries) {
+            InputIterator it(std::string(q), n, dawg);
+            expected.emplace_back(it, InputIterator());
+        }
+    }
+
+    TEST_CHECK(!expected[0].empty());
+    for (size_t t = 0; t < thread_count; ++t) {
+        TEST_CHECK(results[t] == expected);
+    }
+}
+
+void test_generated()
+{
+    for (size_t n = 1; n <= 3; ++n) {
+        LazyTable table(n);
+        size_t count = table.get_state_count();
+        TEST_CHECK(count > 1);
+
+        // loaded tables are closed under transitions
+        for (uint32_t id = 0; id < count; ++id) {
+            for (size_t size = 0; size <= 2 * n + 1; ++size) {
+                for (uint32_t bits = 0; bits < (uint32_t(1) << size); ++bits) {
+                    LazyTable::TTransition transition = table.delta(id, CharVec(bits, size));
+                    TEST_CHECK((transition == LazyTable::DEAD) || (LazyTable::get_target(transition) < count));
+                }
+            }
+        }
+
+        TEST_CHECK(table.get_state_count() == count);
+    }
+
+    LazyTable lazy(4);
+    TEST_CHECK(lazy.get_state_count() == 1);
+}
+
+void test_long_word()
+{
+    // longer than a mask block
+    std::string base;
+    for (size_t i = 0; i < 100; ++i) {
+        base += (i % 3) ? "ab"[i % 2] : 'c';
+    }
+
+    std::string seen = base;
+    seen.replace(70, 1, "ž");
+
+    std::string deleted = base;
+    deleted.erase(64, 1);
+
+    std::string twice = base;
+    twice.replace(10, 1, "x");
+    twice.replace(90, 1, "x");
+
+    std::vector<std::string> v = { base, deleted, twice };
+    Dawg dawg = make_dawg(v);
+
+    InputIterator it(seen, 2, dawg);
+    std::set<std::string> res(it, InputIterator());
+    TEST_CHECK(res.size() == 2);
+    TEST_CHECK(res.count(base) == 1);
+    TEST_CHECK(res.count(deleted) == 1);
+
+    InputIterator it3(seen, 3, dawg);
+    std::set<std::string> res3(it3, InputIterator());
+    TEST_CHECK(res3.size() == 3);
+}
+
+static std::set<std::string> brute_force(const std::vector<std::string> &words, const std::string &seen, size_t n)
+{
+    std::set<std::string> res;
+    for (const std::string &word: words) {
+        if (levenshtein_distance(reinterpret_cast<const unsigned char *>(word.c_str()), reinterpret_cast<const unsigned char *>(seen.c_str())) <= n) {
+            res.insert(word);
+        }
+    }
+
+    return res;
+}
+
+void test_fan_out()
+{
+    // CJK-like dictionary with a big root
+    char buf[5];
+    std::vector<std::string> words;
+    for (uint32_t i = 0; i < 3000; ++i) {
+        std::string word(buf, utf8_encode(buf, 0x4e00 + i));
+        word.append(buf, utf8_encode(buf, 0x4e00 + (i * 7) % 50));
+        words.push_back(word);
+        if (i % 3 == 0) {
+            word.append(buf, utf8_encode(buf, 0x4e00 + i % 11));
+            words.push_back(word);
+        }
+    }
+
+    Dawg dawg = make_dawg(words);
+    const size_t qs[] = { 0, 7, 999, 2999 };
+    for (size_t q: qs) {
+        std::string seen(words[q]);
+        seen.append(buf, utf8_encode(buf, 0x4e01));
+        for (size_t n = 1; n <= 2; ++n) {
+            InputIterator it(seen, n, dawg);
+            std::set<std::string> res(it, InputIterator());
+            TEST_CHECK(res == brute_force(words, seen, n));
+            TEST_MSG("query %zu, n %zu", q, n);
+        }
+    }
+}
+
+template<size_t N>
+void check_specialized(const std::string &word, const std::string &input)
+{
+    Facade generic(word, N);
+    BasicFacade<N> specialized(word);
+    LevenState m = Facade::initial_state();
+    LevenState ms = m;
+    for (unsigned char c: input) {
+        m = generic.delta(m, c);
+        ms = specialized.delta(ms, c);
+        TEST_CHECK(m.is_dead() == ms.is_dead());
+        if (m.is_dead()) {
+            return;
+        }
+
+        TEST_CHECK((m.base == ms.base) && (m.id == ms.id));
+        TEST_CHECK(generic.is_final(m) == specialized.is_final(ms));
+
+        LevenState f = generic.delta_foreign(m);
+        LevenState fs = specialized.delta_foreign(ms);
+        TEST_CHECK(f.is_dead() == fs.is_dead());
+    }
+}
+
+void test_specialized()
+{
+    const char *inputs[] = { "", "a", "ab", "ba", "abcd", "acbd", "xabcdx", "dcba", "aaaaaa" };
+    for (const char *input: inputs) {
+        check_specialized<1>("abcd", input);
+        check_specialized<2>("abcd", input);
+        check_specialized<3>("abcd", input);
+        check_specialized<4>("abcd", input);
+    }
+}
+
+void test_reduced_union()
+{
+    ReducedUnion ru;
+    ru.add(RelPos(1, 2));
+    ru.add(RelPos(3, 1));
+    ru.add(RelPos(0, 0));
+    ru.add(RelPos(1, 1));
+
+    // (0, 0) subsumes (1, 1) and (1, 2), but not (3, 1)
+    std::vector<RelPos> expected = { RelPos(0, 0), RelPos(3, 1) };
+    std::vector<RelPos> got;
+    for (const RelPos &rp: ru) {
+        got.push_back(rp);
+    }
+
+    TEST_CHECK(got == expected);
+
+    ReducedUnion other;
+    other.add_unchecked(RelPos(3, 1));
+    other.add_unchecked(RelPos(0, 0));
+    TEST_CHECK(ru == other);
+    TEST_CHECK(ru.hash() == other.hash());
+
+    ReducedUnion shifted = ru.subtract(0);
+    TEST_CHECK(shifted == ru);
+
+    ReducedUnion raised;
+    raised.add(RelPos(4, 1));
+    raised.add(RelPos(1, 3));
+    TEST_CHECK(raised.get_raise_level() == 1);
+    TEST_CHECK(!(raised.subtract(1) == raised));
+    TEST_CHECK(ReducedUnion().is_empty());
+}
+
+void test_wide()
+{
+    // long product codes over a small alphabet
+    std::vector<std::string> words;
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < 300; ++i) {
+        std::string word;
+        size_t len = 10 + i % 50;
+        for (size_t j = 0; j < len; ++j) {
+            seed = seed * 1103515245 + 12345;
+            word += "abcd"[(seed >> 16) % 4];
+        }
+
+        words.push_back(word);
+    }
+
+    words.push_back("ř");
+    Dawg dawg = make_dawg(words);
+
+    size_t tolerances[] = { 16, 20, 40 };
+    for (size_t n: tolerances) {
+        for (size_t q = 0; q < words.size(); q += 37) {
+            const std::string &seen = words[q];
+            InputIterator it(seen, n, dawg);
+            std::set<std::string> res(it, InputIterator());
+            TEST_CHECK(res == brute_force(words, seen, n));
+            TEST_MSG("query %zu, n %zu", q, n);
+        }
+    }
+
+    // agrees with the universal automaton where both apply
+    for (size_t n = 0; n <= 3; ++n) {
+        Facade facade("abcab", n);
+        WideFacade wide("abcab", n);
+        LevenState m = Facade::initial_state();
+        LevenState mw = WideFacade::initial_state();
+        for (char c: std::string("acbabx")) {
+            m = facade.delta(m, c);
+            mw = wide.delta(mw, c);
+            TEST_CHECK(m.is_dead() == mw.is_dead());
+            if (m.is_dead()) {
+                break;
+            }
+
+            TEST_CHECK(facade.is_final(m) == wide.is_final(mw));
+        }
+    }
+}
+
+void test_lexicographic()
+{
+    std::vector<std::string> words;
+    uint32_t seed = 777;
+    for (size_t i = 0; i < 2000; ++i) {
+        std::string word;
+        size_t len = 1 + i % 23;
+        for (size_t j = 0; j < len; ++j) {
+            seed = seed * 1103515245 + 12345;
+            word += "abcdefgh"[(seed >> 16) % ((j % 3) ? 3 : 8)];
+        }
+
+        if (i % 5 == 0) {
+            word += "č";
+        }
+
+        words.push_back(word);
+    }
+
+    words.push_back("");
+    Dawg dawg = make_dawg(words);
+
+    size_t tolerances[] = { 0, 1, 2, 3, 5, 17 };
+    for (size_t n: tolerances) {
+        for (size_t q = 0; q < words.size(); q += 97) {
+            const std::string &seen = words[q];
+            std::vector<std::string> res;
+            bool ordered = true;
+            for (InputIterator it(seen, n, dawg, SearchOrder::lexicographic), end; it != end; ++it) {
+                std::string word = *it;
+                ordered = ordered && (it.get_ordinal() == dawg.ordinal(word));
+                res.push_back(word);
+            }
+
+            // byte order of UTF-8 is codepoint order
+            std::set<std::string> expected = brute_force(words, seen, n);
+            TEST_CHECK(res == std::vector<std::string>(expected.begin(), expected.end()));
+            TEST_CHECK(ordered);
+            TEST_MSG("query %zu, n %zu", q, n);
+        }
+    }
+}
+
+// submits the words it finds to the pool running it
+class ReentrantSink : public ResultSink
+{
+public:
+    SearchPool &pool;
+    const Dawg &dawg;
+
+    ReentrantSink(SearchPool &p, const Dawg &d):
+        pool(p),
+        dawg(d)
+    {
+    }
+
+    void add(size_t, const std::string &word, uint32_t) override
+    {
+        Query query(word, 0);
+        CollectingSink inner(1);
+        pool.search_batch(dawg, std::span<const Query>(&query, 1), inner);
+    }
+};
+
+void test_batch()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 5000; ++i) {
+        words.push_back(std::to_string(i * 7919 % 100000));
+    }
+
+    Dawg dawg = make_dawg(words);
+
+    std::vector<Query> queries;
+    size_t tolerances[] = { 0, 1, 2, 1, 3, 17 };
+    for (size_t i = 0; i < 200; ++i) {
+        queries.emplace_back(words[i * 13 % words.size()], tolerances[i % 6]);
+    }
+
+    SearchPool pool(4);
+    TEST_CHECK(pool.get_thread_count() == 4);
+    for (size_t round = 0; round < 2; ++round) {
+        CollectingSink sink(queries.size());
+        pool.search_batch(dawg, queries, sink, round ? SearchOrder::lexicographic : SearchOrder::breadth_first);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            InputIterator it(queries[i].word, queries[i].n, dawg, round ? SearchOrder::lexicographic : SearchOrder::breadth_first);
+            TWords expected(it, InputIterator());
+            TEST_CHECK(sink.results[i] == expected);
+            TEST_MSG("query %zu, round %zu", i, round);
+        }
+    }
+
+    // the error of one query is reported, and the pool stays usable
+    std::vector<Query> bad = { Query("12", 1), Query("a\xff", 1) };
+    CollectingSink bad_sink(bad.size());
+    TEST_EXCEPTION(pool.search_batch(dawg, bad, bad_sink), std::runtime_error);
+
+    std::vector<Query> huge = { Query("12", SIZE_MAX) };
+    CollectingSink huge_sink(huge.size());
+    TEST_EXCEPTION(pool.search_batch(dawg, huge, huge_sink), std::runtime_error);
+
+    // a sink can't submit to its own pool
+    ReentrantSink reentrant(pool, dawg);
+    TEST_EXCEPTION(pool.search_batch(dawg, std::span<const Query>(queries.data(), 1), reentrant), std::runtime_error);
+
+    CollectingSink sink(1);
+    search_batch(dawg, std::span<const Query>(queries.data(), 1), sink);
+    TEST_CHECK(!sink.results[0].empty());
+
+    CollectingSink again(1);
+    pool.search_batch(dawg, std::span<const Query>(queries.data(), 1), again);
+    TEST_CHECK(again.results[0] == sink.results[0]);
+}
+
+class OrderedSink : public ResultSink
+{
+public:
+    TWords words;
+    std::vector<uint32_t> ordinals;
+    size_t done_count;
+
+    OrderedSink():
+        done_count(0)
+    {
+    }
+
+    void add(size_t index, const std::string &word, uint32_t ordinal) override
+    {
+        TEST_CHECK(index == 0);
+        words.push_back(word);
+        ordinals.push_back(ordinal);
+    }
+
+    void done(size_t) override
+    {
+        ++done_count;
+    }
+};
+
+void test_split()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 20000; ++i) {
+        std::string word = std::to_string(i * 7919 % 100003);
+        words.push_back((i % 7) ? word : word + "ř");
+    }
+
+    words.push_back("");
+    Dawg dawg = make_dawg(words);
+
+    SearchPool pool(3);
+    const char *seens[] = { "12345", "7", "", "99ř" };
+    size_t tolerances[] = { 0, 1, 2, 3, 4, 6, 17 };
+    for (const char *seen: seens) {
+        for (size_t n: tolerances) {
+            OrderedSink sink;
+            pool.search_parallel(dawg, Query(seen, n), sink);
+
+            TWords expected;
+            std::vector<uint32_t> ordinals;
+            for (InputIterator it(seen, n, dawg, SearchOrder::lexicographic), end; it != end; ++it) {
+                expected.push_back(*it);
+                ordinals.push_back(it.get_ordinal());
+            }
+
+            TEST_CHECK(sink.words == expected);
+            TEST_CHECK(sink.ordinals == ordinals);
+            TEST_CHECK(sink.done_count == 1);
+            TEST_MSG("query %s, n %zu", seen, n);
+
+            // restricted to a prefix
+            TWords restricted;
+            for (const std::string &word: expected) {
+                if (word.starts_with("12")) {
+                    restricted.push_back(word);
+                }
+            }
+
+            InputIterator it(seen, n, dawg, std::string("12"));
+            TEST_CHECK(TWords(it, InputIterator()) == restricted);
+        }
+    }
+}
+
+void test_shared()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 5000; ++i) {
+        std::string word = std::to_string(i * 7919 % 100003);
+        words.push_back((i % 5) ? word : "ř" + word);
+    }
+
+    words.push_back("");
+    Dawg dawg = make_dawg(words);
+
+    std::vector<Query> queries;
+    const char *seens[] = { "12345", "7", "", "ř99", "1234" };
+    size_t tolerances[] = { 0, 1, 2, 3, 5, 17 };
+    for (const char *seen: seens) {
+        for (size_t n: tolerances) {
+            queries.emplace_back(seen, n);
+        }
+    }
+
+    CollectingSink sink(queries.size());
+    search_shared(dawg, queries, sink);
+    for (size_t i = 0; i < queries.size(); ++i) {
+        const Query &query = queries[i];
+        InputIterator it(query.word, query.n, dawg, SearchOrder::lexicographic);
+        TEST_CHECK(sink.results[i] == TWords(it, InputIterator()));
+        TEST_MSG("query %s, n %zu", query.word.c_str(), query.n);
+    }
+}
+
+void test_interleaved()
+{
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 5000; ++i) {
+        std::string word = std::to_string(i * 7919 % 100003);
+        words.push_back((i % 5) ? word : "ř" + word);
+    }
+
+    words.push_back("");
+    Dawg dawg = make_dawg(words);
+
+    std::vector<Query> queries;
+    const char *seens[] = { "12345", "7", "", "ř99", "1234" };
+    size_t tolerances[] = { 0, 1, 2, 3, 5, 17 };
+    for (const char *seen: seens) {
+        for (size_t n: tolerances) {
+            queries.emplace_back(seen, n);
+        }
+    }
+
+    size_t widths[] = { 1, 4, 100 };
+    for (size_t width: widths) {
+        CollectingSink sink(queries.size());
+        search_interleaved(dawg, queries, sink, width);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const Query &query = queries[i];
+            InputIterator it(query.word, query.n, dawg, SearchOrder::lexicographic);
+            TEST_CHECK(sink.results[i] == TWords(it, InputIterator()));
+            TEST_MSG("query %s, n %zu, width %zu", query.word.c_str(), query.n, width);
+        }
+    }
+
+    std::vector<Query> invalid = { Query("1", 1), Query("\xff", 1) };
+    CollectingSink sink(invalid.size());
+    TEST_EXCEPTION(search_interleaved(dawg, invalid, sink), std::runtime_error);
+}
+
 TEST_LIST = {
    { "initial_final", test_initial_final },
+   { "reduced_union", test_reduced_union },
    { "foo", test_foo },
    { "this", test_this },
    { "long_head", test_long_head },
    { "tolerance", test_tolerance },
    { "binary", test_binary },
+   { "frozen", test_frozen },
+   { "save_load", test_save_load },
+   { "insert_erase", test_insert_erase },
+   { "parallel", test_parallel },
+   { "streaming", test_streaming },
+   { "external", test_external },
+   { "contains", test_contains },
+   { "ordinal", test_ordinal },
+   { "concurrent", test_concurrent },
+   { "generated", test_generated },
+   { "long_word", test_long_word },
+   { "fan_out", test_fan_out },
+   { "specialized", test_specialized },
+   { "wide", test_wide },
+   { "lexicographic", test_lexicographic },
+   { "batch", test_batch },
+   { "split", test_split },
+   { "shared", test_shared },
+   { "interleaved", test_interleaved },
    { nullptr, nullptr }
 };